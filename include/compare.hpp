@@ -0,0 +1,31 @@
+#ifndef __COMPARE_HH__
+#define __COMPARE_HH__
+
+/**
+ * Default comparator and projection for the sorting and selection templates.
+ * Algorithms compare elements as cmp(proj(a), proj(b)), e.g. to order
+ * records by one field without copying them pass a projection returning
+ * a reference to that field
+ * @author Denis Kokarev
+ */
+#include <utility>
+
+/**
+ * operator< on any pair of types
+ */
+struct Less {
+	template<class A, class B> bool operator()(const A &a, const B &b) const {
+		return a < b;
+	}
+};
+
+/**
+ * element itself
+ */
+struct Identity {
+	template<class T> T &&operator()(T &&v) const {
+		return std::forward<T>(v);
+	}
+};
+
+#endif // __COMPARE_HH__
@@ -0,0 +1,222 @@
+#ifndef __CORO_HH__
+#define __CORO_HH__
+
+/**
+ * Coroutine-based conveyor primitives, requires C++20
+ * @author Denis Kokarev
+ */
+#include <coroutine>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <utility>
+
+class CoroExecutor;
+
+/**
+ * Fire-and-forget coroutine. Does not start until it is spawned
+ * on a CoroExecutor, the frame is destroyed when it completes
+ */
+class CoroTask {
+	friend CoroExecutor;
+public:
+	struct promise_type {
+		CoroExecutor *exec = nullptr;
+		CoroTask get_return_object() {
+			return CoroTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		struct FinalAwaiter {
+			bool await_ready() noexcept {
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+			void await_resume() noexcept {
+			}
+		};
+		FinalAwaiter final_suspend() noexcept {
+			return {};
+		}
+		void return_void() {
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+private:
+	std::coroutine_handle<promise_type> h;
+	CoroTask(std::coroutine_handle<promise_type> h):h(h) {
+	}
+public:
+	CoroTask(CoroTask &&b):h(std::exchange(b.h, nullptr)) {
+	}
+	CoroTask(const CoroTask &) = delete;
+	~CoroTask() {
+		if (h)
+			h.destroy(); // never spawned
+	}
+};
+
+/**
+ * Small pool of threads multiplexing any number of coroutines.
+ * Coroutines are resumed in FIFO order by whichever thread is free
+ */
+class CoroExecutor {
+	friend CoroTask::promise_type::FinalAwaiter;
+	std::vector<std::thread> threads;
+	std::mutex mtx;
+	std::condition_variable cv_ready;
+	std::condition_variable cv_idle;
+	std::deque<std::coroutine_handle<>> ready;
+	int tasks;
+	bool stop;
+	void run();
+	void task_done();
+public:
+	CoroExecutor(int nthreads);
+	~CoroExecutor();
+	/**
+	 * Start the task on the pool
+	 */
+	void spawn(CoroTask &&task);
+	/**
+	 * Queue suspended coroutine for resumption
+	 */
+	void schedule(std::coroutine_handle<> h);
+	/**
+	 * Block until all spawned tasks are complete
+	 */
+	void wait();
+};
+
+/**
+ * Bounded channel connecting coroutine stages
+ * A stage co_awaits pop() to obtain the previous stage's output, which
+ * yields an empty optional once the channel is closed and drained.
+ * co_await push(v) suspends while the channel is full and yields false
+ * if the channel was closed. Either side may close the channel, a consumer
+ * closes it to tell the producer to stop.
+ * A suspended side is resumed on the executor by the other side, so
+ * neither of them ever blocks a pool thread
+ */
+template<class T> class CoroChannel {
+	struct PushAwaiter;
+	struct PopAwaiter;
+	CoroExecutor &exec;
+	size_t capacity;
+	std::mutex mtx;
+	std::deque<T> buf;
+	std::deque<PushAwaiter*> pushers;
+	std::deque<PopAwaiter*> poppers;
+	bool closed;
+
+	struct PushAwaiter {
+		CoroChannel &ch;
+		T value;
+		bool ok;
+		std::coroutine_handle<> h;
+		bool await_ready() {
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> hh) {
+			std::lock_guard<std::mutex> lck(ch.mtx);
+			if (ch.closed) {
+				ok = false;
+				return false;
+			}
+			if (!ch.poppers.empty()) {
+				// hand over directly to the waiting consumer
+				PopAwaiter *p = ch.poppers.front();
+				ch.poppers.pop_front();
+				p->value.emplace(std::move(value));
+				ch.exec.schedule(p->h);
+				return false;
+			}
+			if (ch.buf.size() < ch.capacity) {
+				ch.buf.push_back(std::move(value));
+				return false;
+			}
+			h = hh;
+			ch.pushers.push_back(this);
+			return true;
+		}
+		bool await_resume() {
+			return ok;
+		}
+	};
+
+	struct PopAwaiter {
+		CoroChannel &ch;
+		std::optional<T> value;
+		std::coroutine_handle<> h;
+		bool await_ready() {
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> hh) {
+			std::lock_guard<std::mutex> lck(ch.mtx);
+			if (!ch.buf.empty()) {
+				value.emplace(std::move(ch.buf.front()));
+				ch.buf.pop_front();
+				if (!ch.pushers.empty()) {
+					// let the waiting producer refill
+					PushAwaiter *p = ch.pushers.front();
+					ch.pushers.pop_front();
+					ch.buf.push_back(std::move(p->value));
+					ch.exec.schedule(p->h);
+				}
+				return false;
+			}
+			if (!ch.pushers.empty()) {
+				// capacity 0, take directly from the producer
+				PushAwaiter *p = ch.pushers.front();
+				ch.pushers.pop_front();
+				value.emplace(std::move(p->value));
+				ch.exec.schedule(p->h);
+				return false;
+			}
+			if (ch.closed)
+				return false;
+			h = hh;
+			ch.poppers.push_back(this);
+			return true;
+		}
+		std::optional<T> await_resume() {
+			return std::move(value);
+		}
+	};
+public:
+	/**
+	 * @param exec - executor to resume the suspended sides on
+	 * @param capacity - how many items may be buffered
+	 */
+	CoroChannel(CoroExecutor &exec, size_t capacity = 16):exec(exec),capacity(capacity),closed(false) {
+	}
+	PushAwaiter push(T v) {
+		return PushAwaiter {*this, std::move(v), true, nullptr};
+	}
+	PopAwaiter pop() {
+		return PopAwaiter {*this, std::nullopt, nullptr};
+	}
+	/**
+	 * No more items will be pushed. Buffered items can still be popped
+	 */
+	void close() {
+		std::lock_guard<std::mutex> lck(mtx);
+		closed = true;
+		for (auto p:poppers)
+			exec.schedule(p->h);
+		poppers.clear();
+		for (auto p:pushers) {
+			p->ok = false;
+			exec.schedule(p->h);
+		}
+		pushers.clear();
+	}
+};
+
+#endif // __CORO_HH__
@@ -1,5 +1,20 @@
+#ifndef __HEAP_HH__
+#define __HEAP_HH__
+
 #include <cstdlib>
 #include <algorithm>
+#include <iterator>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <cassert>
+#include "compare.hpp"
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /**
  * when our root element increased we need to sieve it down to bring
@@ -7,24 +22,27 @@
  * @param n - the node that we need to bring down 
  * @param begin - vector (random access iterator) of values
  * @param sz - vector size
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
  */
-template <typename TI> void sift_node(
+template <typename TI, class Cmp = Less, class Proj = Identity> void sift_node(
 	  typename std::iterator_traits<TI>::difference_type n,
 	  TI const begin,
-	  const typename std::iterator_traits<TI>::difference_type sz
+	  const typename std::iterator_traits<TI>::difference_type sz,
+	  Cmp cmp = Cmp(),
+	  Proj proj = Proj()
 ) {
 	auto c = n*2+1;	// left child
 	while (c+1 < sz) { // while right child available
-		if (begin[c+1] < begin[c])
+		if (cmp(proj(begin[c+1]), proj(begin[c])))
 			c++; // switch to right child
-		if (begin[c] < begin[n])
+		if (cmp(proj(begin[c]), proj(begin[n])))
 			std::swap(begin[c], begin[n]);
 		else
 			break;
 		n = c;
 		c = n*2+1; // left child
 	}
-	if (c < sz && begin[c] < begin[n])
+	if (c < sz && cmp(proj(begin[c]), proj(begin[n])))
 		std::swap(begin[c], begin[n]);
 }
 
@@ -32,26 +50,349 @@ template <typename TI> void sift_node(
  * Turn elements of random access container into min-heap. The smallest element will be at pos 0
  * @param begin
  * @param end
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
  * expecting (end-begin) > 0
  */
-template <typename TI> void heapify(TI begin, TI end) {
+template <typename TI, class Cmp = Less, class Proj = Identity> void heapify(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
 	const auto sz = end-begin;
 	const auto hsz = sz/2-1;
 	for (auto r=hsz; r>=0; r--)
-		sift_node(r, begin, sz);
+		sift_node(r, begin, sz, cmp, proj);
 }
 
 /**
  * Perform inverted sorting - greatest element will be first
  * @param begin, end - the vector to be sorted
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
  * expecting (end-begin) > 0
  */
-template <typename TI> void heapsort(TI begin, TI end) {
-	heapify(begin, end);
+template <typename TI, class Cmp = Less, class Proj = Identity> void heapsort(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	heapify(begin, end, cmp, proj);
 	TI p(end);
 	auto sz = end-begin;
 	for (--p,--sz; p>begin; --p,--sz) {
 		std::swap(*begin, *p);
-		sift_node(0, begin, sz);
+		sift_node(0, begin, sz, cmp, proj);
 	}
 }
+
+/**
+ * d-ary min-heap, children of node n are at D*n+1 .. D*n+D
+ * The children of a node are adjacent, so each level of a sift reads D neighbouring
+ * values (the groups are not aligned to cache lines, a group may span two of them),
+ * and the heap is log2(D) times shallower than the binary one
+ */
+
+/**
+ * position of the smallest among D children starting at c
+ */
+template <int D, typename TI, class Cmp, class Proj> int dary_min_child(TI c, Cmp cmp, Proj proj) {
+	int m = 0;
+	for (int i=1; i<D; i++)
+		if (cmp(proj(c[i]), proj(c[m])))
+			m = i;
+	return m;
+}
+
+#if defined(__SSE2__)
+// SIMD min-reduction for int children in natural order
+inline __m128i dary_min_epi32(__m128i a, __m128i b) {
+#if defined(__SSE4_1__)
+	return _mm_min_epi32(a, b);
+#else
+	__m128i lt = _mm_cmplt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(lt, a), _mm_andnot_si128(lt, b));
+#endif
+}
+
+// broadcast the minimum of 4 lanes
+inline __m128i dary_hmin_epi32(__m128i x) {
+	x = dary_min_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	return dary_min_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+inline int dary_lane_mask(__m128i x, __m128i m) {
+	return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, m)));
+}
+
+template <> inline int dary_min_child<4>(int *c, Less, Identity) {
+	__m128i x = _mm_loadu_si128((const __m128i*)c);
+	return __builtin_ctz(dary_lane_mask(x, dary_hmin_epi32(x)));
+}
+
+template <> inline int dary_min_child<8>(int *c, Less, Identity) {
+	__m128i lo = _mm_loadu_si128((const __m128i*)c);
+	__m128i hi = _mm_loadu_si128((const __m128i*)(c+4));
+	__m128i m = dary_hmin_epi32(dary_min_epi32(lo, hi));
+	return __builtin_ctz(dary_lane_mask(lo, m) | (dary_lane_mask(hi, m) << 4));
+}
+#endif
+
+/**
+ * Floyd's bottom-up sift: move the hole from n down to a leaf always following
+ * the smallest child, then bring the displaced value back up from there. Each
+ * level costs one min-reduction over the children and a single move, no swaps
+ * @param n - the node that we need to bring down
+ * @param begin - vector (random access iterator) of values
+ * @param sz - vector size
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
+ */
+template <int D, typename TI, class Cmp = Less, class Proj = Identity> void dary_sift_node(
+	  typename std::iterator_traits<TI>::difference_type n,
+	  TI const begin,
+	  const typename std::iterator_traits<TI>::difference_type sz,
+	  Cmp cmp = Cmp(),
+	  Proj proj = Proj()
+) {
+	const auto top = n;
+	auto v = std::move(begin[n]);
+	auto c = n*D+1;	// first child
+	while (c+D <= sz) { // all D children available
+		c += dary_min_child<D>(begin+c, cmp, proj);
+		begin[n] = std::move(begin[c]);
+		n = c;
+		c = n*D+1;
+	}
+	if (c < sz) { // incomplete last group
+		auto m = c;
+		for (auto i=c+1; i<sz; i++)
+			if (cmp(proj(begin[i]), proj(begin[m])))
+				m = i;
+		begin[n] = std::move(begin[m]);
+		n = m;
+	}
+	while (n > top) {
+		auto p = (n-1)/D;
+		if (!cmp(proj(v), proj(begin[p])))
+			break;
+		begin[n] = std::move(begin[p]);
+		n = p;
+	}
+	begin[n] = std::move(v);
+}
+
+/**
+ * Turn elements of random access container into d-ary min-heap
+ * @param begin
+ * @param end
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
+ */
+template <int D = 4, typename TI, class Cmp = Less, class Proj = Identity> void dary_heapify(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	const auto sz = end-begin;
+	for (auto r=(sz-2)/D; sz>1 && r>=0; r--)
+		dary_sift_node<D>(r, begin, sz, cmp, proj);
+}
+
+/**
+ * Perform inverted sorting with d-ary heap - greatest element will be first
+ * @param begin, end - the vector to be sorted
+ * @param cmp, proj - elements are ordered by cmp(proj(a), proj(b))
+ */
+template <int D = 4, typename TI, class Cmp = Less, class Proj = Identity> void dary_heapsort(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	dary_heapify<D>(begin, end, cmp, proj);
+	auto sz = end-begin;
+	for (--sz; sz>0; --sz) {
+		std::swap(begin[0], begin[sz]);
+		dary_sift_node<D>(0, begin, sz, cmp, proj);
+	}
+}
+
+/**
+ * Addressable min-priority queue for Dijkstra-like loops.
+ * Elements are identified by handles 0..capacity-1 chosen by the caller, e.g.
+ * graph vertex numbers. Each handle may be in the queue at most once, its key
+ * can be lowered in O(log N) with decrease().
+ * Keys live in a separate array indexed by handle and the d-ary heap holds only
+ * the handles, so moving the hole costs one handle move and one position update
+ * @param K - key type
+ * @param C - key comparator, the smallest key is on top
+ * @param D - heap arity
+ */
+template<class K, class C = std::less<K>, int D = 4> class IndexedHeap {
+public:
+	static constexpr size_t npos = size_t(-1);
+private:
+	std::vector<K> keys;	// by handle
+	std::vector<size_t> pos;	// position in heap by handle, npos if absent
+	std::vector<size_t> heap;	// handles
+	C cmp;
+	void place(size_t n, size_t h) {
+		heap[n] = h;
+		pos[h] = n;
+	}
+	// bring handle h up from the hole at n
+	void sift_up(size_t n, size_t h) {
+		while (n > 0) {
+			size_t p = (n-1)/D;
+			if (!cmp(keys[h], keys[heap[p]]))
+				break;
+			place(n, heap[p]);
+			n = p;
+		}
+		place(n, h);
+	}
+	// bring handle h down from the hole at n
+	void sift_down(size_t n, size_t h) {
+		const size_t sz = heap.size();
+		size_t c = n*D+1;
+		while (c < sz) {
+			size_t m = c;
+			size_t e = std::min(c+D, sz);
+			for (size_t i=c+1; i<e; i++)
+				if (cmp(keys[heap[i]], keys[heap[m]]))
+					m = i;
+			if (!cmp(keys[heap[m]], keys[h]))
+				break;
+			place(n, heap[m]);
+			n = m;
+			c = n*D+1;
+		}
+		place(n, h);
+	}
+public:
+	/**
+	 * @param capacity - handles are in [0, capacity)
+	 */
+	IndexedHeap(size_t capacity, const C &cmp = C()):keys(capacity),pos(capacity, npos),cmp(cmp) {
+		heap.reserve(capacity);
+	}
+	bool empty() const {
+		return heap.empty();
+	}
+	size_t size() const {
+		return heap.size();
+	}
+	bool contains(size_t h) const {
+		return pos[h] != npos;
+	}
+	const K &key(size_t h) const {
+		return keys[h];
+	}
+	/**
+	 * handle with the smallest key
+	 */
+	size_t top() const {
+		return heap[0];
+	}
+	/**
+	 * handle h must not be in the queue
+	 */
+	void push(size_t h, const K &k) {
+		assert(!contains(h));
+		keys[h] = k;
+		heap.push_back(h);
+		sift_up(heap.size()-1, h);
+	}
+	/**
+	 * remove the top
+	 */
+	void pop() {
+		erase(heap[0]);
+	}
+	/**
+	 * lower the key of handle h, k must not be greater than the current one
+	 */
+	void decrease(size_t h, const K &k) {
+		keys[h] = k;
+		sift_up(pos[h], h);
+	}
+	/**
+	 * push h or lower its key if k is smaller, the usual relaxation step
+	 * @return true if the key was changed
+	 */
+	bool push_or_decrease(size_t h, const K &k) {
+		if (!contains(h)) {
+			push(h, k);
+			return true;
+		} else if (cmp(k, keys[h])) {
+			decrease(h, k);
+			return true;
+		} else {
+			return false;
+		}
+	}
+	/**
+	 * remove handle h from the queue
+	 */
+	void erase(size_t h) {
+		size_t n = pos[h];
+		pos[h] = npos;
+		size_t last = heap.back();
+		heap.pop_back();
+		if (last == h)
+			return;
+		if (n > 0 && cmp(keys[last], keys[heap[(n-1)/D]]))
+			sift_up(n, last);
+		else
+			sift_down(n, last);
+	}
+};
+
+// the constructor binds npos to a reference, so it needs a definition
+template<class K, class C, int D> constexpr size_t IndexedHeap<K, C, D>::npos;
+
+/**
+ * Radix heap - monotone priority queue for unsigned integer keys. Every
+ * pushed key must not be smaller than the last popped one, which holds
+ * for Dijkstra with non-negative weights. Items are kept in buckets by
+ * the highest bit in which the key differs from the last popped key, so
+ * each item is moved between buckets at most 64 times: push is O(1) and
+ * pop is amortized O(log C) where C is the key range.
+ * There is no decrease-key, push the item again and skip stale entries
+ * @param V - value carried along with the key
+ */
+template<class V> class RadixHeap {
+	static constexpr int nbuckets = 65;
+	std::vector<std::pair<uint64_t, V>> bucket[nbuckets];
+	uint64_t last;
+	size_t sz;
+	static int bucket_of(uint64_t k, uint64_t last) {
+		return k == last ? 0 : 64-__builtin_clzll(k^last);
+	}
+	// move the smallest items into bucket 0
+	void pull() {
+		if (!bucket[0].empty())
+			return;
+		int b = 1;
+		while (bucket[b].empty())
+			b++;
+		uint64_t m = bucket[b][0].first;
+		for (auto &kv:bucket[b])
+			m = std::min(m, kv.first);
+		last = m;
+		for (auto &kv:bucket[b])
+			bucket[bucket_of(kv.first, last)].push_back(std::move(kv));
+		bucket[b].clear();
+	}
+public:
+	RadixHeap():last(0),sz(0) {
+	}
+	bool empty() const {
+		return sz == 0;
+	}
+	size_t size() const {
+		return sz;
+	}
+	/**
+	 * k must not be smaller than the last popped key
+	 */
+	void push(uint64_t k, const V &v) {
+		assert(k >= last);
+		bucket[bucket_of(k, last)].emplace_back(k, v);
+		sz++;
+	}
+	/**
+	 * smallest key and its value
+	 */
+	const std::pair<uint64_t, V> &top() {
+		pull();
+		return bucket[0].back();
+	}
+	void pop() {
+		pull();
+		bucket[0].pop_back();
+		sz--;
+	}
+};
+
+#endif // __HEAP_HH__
@@ -2,19 +2,92 @@
 #define __NTH_ELEMENT_HH__
 
 #include <vector>
+#include <utility>
 #include "partition.hpp"
 
-// compute k-th order statistics
-template<class T> void my_nth_element(std::vector<T> &vv, size_t k) {
-	size_t l=0, r=vv.size()-1;
-	Range range = partition3way(vv, l, r);
-	while (!(range.begin<=k && k<range.end)) {
-		if (k < range.begin)
-			r = range.begin-1;
+// sort short [begin..end) by insertion
+template<class TI, class Cmp, class Proj> void select_insertion_sort(TI begin, TI end, Cmp &cmp, Proj &proj) {
+	for (TI i=begin+1; i<end; ++i)
+		for (TI j=i; j>begin && cmp(proj(j[0]), proj(j[-1])); --j)
+			std::swap(j[0], j[-1]);
+}
+
+// offset of the median of begin[a], begin[b] and begin[c]
+template<class TI, class Cmp, class Proj> size_t select_median3(TI begin, size_t a, size_t b, size_t c, Cmp &cmp, Proj &proj) {
+	if (cmp(proj(begin[b]), proj(begin[a])))
+		std::swap(a, b);
+	if (cmp(proj(begin[c]), proj(begin[b]))) {
+		b = c;
+		if (cmp(proj(begin[b]), proj(begin[a])))
+			b = a;
+	}
+	return b;
+}
+
+// Tukey's ninther - median of 3 medians of 3 spread over [0..n)
+template<class TI, class Cmp, class Proj> size_t select_ninther(TI begin, size_t n, Cmp &cmp, Proj &proj) {
+	const size_t s = n/8, m = n/2;
+	return select_median3(begin,
+		select_median3(begin, 0, s, 2*s, cmp, proj),
+		select_median3(begin, m-s, m, m+s, cmp, proj),
+		select_median3(begin, n-1-2*s, n-1-s, n-1, cmp, proj), cmp, proj);
+}
+
+template<class TI, class Cmp = Less, class Proj = Identity> void introselect(TI begin, TI nth, TI end, Cmp cmp = Cmp(), Proj proj = Proj(), int bad_partitions = 4);
+
+// median of medians of 5 for [0..n), n >= 5, the group medians are gathered at the front
+// @return offset of the pivot which has at least 3/10 of elements on each side
+template<class TI, class Cmp, class Proj> size_t select_median_of_medians(TI begin, size_t n, Cmp &cmp, Proj &proj) {
+	size_t m = 0;
+	for (size_t i=0; i+5<=n; i+=5, m++) {
+		select_insertion_sort(begin+i, begin+i+5, cmp, proj);
+		std::swap(begin[m], begin[i+2]);
+	}
+	introselect(begin, begin+m/2, begin+m, cmp, proj);
+	return m/2;
+}
+
+// introselect - k-th order statistics on [begin..end) in O(N) worst case
+// pivots are median of 3 or ninther for large ranges, partitioning keeping more than
+// 3/4 of the range is bad, after bad_partitions of them the pivots are medians of medians
+// elements are ordered by cmp(proj(a), proj(b))
+template<class TI, class Cmp, class Proj> void introselect(TI begin, TI nth, TI end, Cmp cmp, Proj proj, int bad_partitions) {
+	const size_t k = nth-begin;
+	size_t l=0, r=end-begin;
+	if (k >= r)
+		return;
+	while (r-l > 16) {
+		const size_t n = r-l;
+		TI b = begin+l;
+		size_t p;
+		if (bad_partitions > 0)
+			p = n >= 128 ? select_ninther(b, n, cmp, proj) : select_median3(b, 0, n/2, n-1, cmp, proj);
 		else
-			l = range.end;
-		range = partition3way(vv, l, r);
+			p = select_median_of_medians(b, n, cmp, proj);
+		std::swap(b[p], b[n-1]);
+		Range range = partition3way_block(b, b+n, cmp, proj);
+		if (k < l+range.begin) {
+			r = l+range.begin;
+		} else if (k >= l+range.end) {
+			l += range.end;
+		} else {
+			return;
+		}
+		if (4*(r-l) > 3*n)
+			bad_partitions--;
 	}
+	select_insertion_sort(begin+l, begin+r, cmp, proj);
+}
+
+// compute k-th order statistics on [begin..end), i.e. place nth where it would be in sorted sequence
+// elements are ordered by cmp(proj(a), proj(b))
+template<class TI, class Cmp = Less, class Proj = Identity> void my_nth_element(TI begin, TI nth, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	introselect(begin, nth, end, cmp, proj);
+}
+
+// compute k-th order statistics
+template<class T, class Cmp = Less, class Proj = Identity> void my_nth_element(std::vector<T> &vv, size_t k, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	my_nth_element(vv.begin(), vv.begin()+k, vv.end(), cmp, proj);
 }
 
 #endif // __NTH_ELEMENT_HH__
@@ -9,17 +9,104 @@
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <atomic>
+#include <exception>
+#ifdef YALG_PAR_STATS
+#include <cstdint>
+#include <ostream>
+#endif
+
+#ifdef YALG_PAR_STATS
+/**
+ * Instrumentation counters, compiled in only when YALG_PAR_STATS is defined
+ * (cmake -DYALG_PAR_STATS=ON). The same definition must be used for the library
+ * and its users.
+ *
+ * Every ParallelExec thread and every conveyor element keeps its own counters,
+ * updated only by its own thread. Query them while the object is idle, i.e.
+ * between exec() calls or after the conveyor output is consumed.
+ *
+ * items - exec_slice() or next() calls
+ * busy_ns - time spent in these calls
+ * wait_parent_ns - ParallelExec: time idle in between exec() calls,
+ *   conveyor: time blocked waiting for the parent's result
+ * wait_child_ns - conveyor: time blocked waiting for the next stage to ask
+ *   for more, ParallelExec: unused
+ * hist[i] - number of calls which took [2^i, 2^(i+1)) ns
+ */
+struct ParStats {
+	static constexpr int buckets = 40;
+	int tid;
+	uint64_t items;
+	uint64_t busy_ns;
+	uint64_t wait_parent_ns;
+	uint64_t wait_child_ns;
+	uint64_t hist[buckets];
+	ParStats();
+	void add_busy(uint64_t start_ns, uint64_t end_ns);
+	static uint64_t now_ns();
+};
+
+/**
+ * Chrome trace (chrome://tracing or Perfetto) of all exec_slice() and conveyor
+ * next() calls made between start() and stop(). Each ParallelExec slice and
+ * conveyor element shows up as a separate thread named after its class
+ */
+class ParTrace {
+public:
+	static void start();
+	static void stop();
+	static void dump(std::ostream &os);
+};
+#else
+/**
+ * Without YALG_PAR_STATS the counters are empty and updating them compiles to nothing
+ */
+struct ParStats {
+};
+#endif // YALG_PAR_STATS
+
+/**
+ * Placement of ParallelExec threads onto CPUs
+ * NONE - let the OS migrate the threads freely
+ * COMPACT - fill the CPUs of one NUMA node before moving to the next
+ * SCATTER - deal the threads round-robin across NUMA nodes
+ * LIST - thread n runs on cpus[n % cpus.size()]
+ * Only effective on Linux, elsewhere the threads are never pinned
+ */
+struct ParAffinity {
+	enum Policy {
+		NONE,
+		COMPACT,
+		SCATTER,
+		LIST
+	};
+	Policy policy;
+	std::vector<int> cpus;
+	ParAffinity(Policy policy = NONE):policy(policy) {
+	}
+	ParAffinity(const std::vector<int> &cpus):policy(LIST),cpus(cpus) {
+	}
+};
 
 /**
  * Simple parallel execution. Start n threads and have them all run their exec_slice()
  * in the loop. All exec_slice()es executed once for every exec() command
  * Derive your class, add data fields and overload exec_slice(n).
  * Threads created at constructor and joined at destructor.
+ * Threads may be pinned to CPUs, then slice n always runs on the same CPU and the
+ * data first touched by it resides on its NUMA node, see first_touch()
  */
 class ParallelExec {
 protected:
 	int nthreads;
 private:
+	// cpu and numa node of every slice, -1 when not pinned
+	std::vector<int> cpus;
+	std::vector<int> nodes;
 	// marching tick for threads
 	int tick;
 	// pre-spawn this many threads
@@ -37,11 +124,34 @@ private:
 	void threads_done();
 	static void run_thread(ParallelExec *th, int n);
 	void run(int n);
+	void place(const ParAffinity &affinity);
+	std::vector<ParStats> stats;
+#ifdef YALG_PAR_STATS
+public:
+	const ParStats &slice_stats(int n) const;
+#endif
 protected:
 	virtual void exec_slice(int n) = 0;
 	ParallelExec(int nthreads);
+	ParallelExec(int nthreads, const ParAffinity &affinity);
 	~ParallelExec();
 	void exec();
+	int slice_cpu(int n) const;
+	int slice_node(int n) const;
+	/**
+	 * [lo, hi) block of sz elements which belongs to slice n
+	 */
+	void slice_block(int n, size_t sz, size_t &lo, size_t &hi) const;
+	/**
+	 * Call from exec_slice(n) to fill slice's own block of freshly allocated buf
+	 * with v. The OS backs a page with memory of the node which touches it first,
+	 * so buf must not be initialized elsewhere, i.e. allocate it as new T[sz]
+	 */
+	template<class T> void first_touch(int n, T *buf, size_t sz, const T &v = T()) const {
+		size_t lo, hi;
+		slice_block(n, sz, lo, hi);
+		std::fill(buf+lo, buf+hi, v);
+	}
 };
 
 /**
@@ -67,21 +177,58 @@ protected:
  *
  * Each conveyor element may use 'batch' counter to determine which copy
  * of the result to work on this iteration
+ *
+ * Batch mode: PipeHeadExec may be constructed with chunk > 1. Then the head
+ * produces up to chunk results per handshake and every stage consumes the whole
+ * chunk of its parent per handshake, which amortizes the synchronization cost
+ * for small elements. 'batch' counts individual results, so each conveyor
+ * element has to store at least 2*chunk instances of results (3*chunk if
+ * passed further). PipeOutputIterator walks through the chunks transparently
+ *
+ * Only the head ends the data with nullptr, stages may return nullptr as
+ * a valid result.
+ *
+ * Termination: an exception thrown by any next() stops the conveyor and is
+ * rethrown by PipeOutputIterator. A PipeCancelToken given to the head stops the
+ * conveyor from outside, the iteration then simply ends. Destroying the conveyor
+ * before it is exhausted stops it as well. In all these cases the elements drop
+ * the rest of their current chunk, and a long next() may poll cancelled()
+ * to give up early.
  */
 class PipeStageExec;
 class PipeOutputIterator;
 
+/**
+ * Cancellation flag which may be shared by several conveyors
+ */
+class PipeCancelToken {
+	std::shared_ptr<std::atomic<bool>> flag;
+public:
+	PipeCancelToken();
+	void cancel();
+	bool cancelled() const;
+};
+
 class PipeHeadExec {
 	friend PipeStageExec;
 	friend PipeOutputIterator;
 protected:
 	int batch;
+	// max number of results per handshake
+	const int chunk;
+	// the conveyor is being stopped
+	bool cancelled() const;
 private:
 	bool go;
 	bool done;
 	bool abort;
-	int depth;
-	void *last_arg;
+	// results of the last handshake
+	std::vector<void*> last_args;
+	// exception thrown by this or preceding element
+	std::exception_ptr error;
+	// user's cancellation and conveyor's own stop flag
+	PipeCancelToken cancel_token;
+	std::shared_ptr<std::atomic<bool>> halt;
 	std::mutex mtx;
 	std::condition_variable cv;
 	void thread_wait_go();
@@ -89,10 +236,19 @@ private:
 	void thread_notify_abort();
 	void thread_wait_done();
 	void thread_notify_done();
+	void stop(std::exception_ptr e);
 	virtual void run();
 	virtual void *next() = 0;
+	void *invoke_next();
+protected:
+	ParStats stats;
+#ifdef YALG_PAR_STATS
+public:
+	const ParStats &pipe_stats() const;
+#endif
 public:
-	PipeHeadExec();
+	PipeHeadExec(int chunk = 1, const PipeCancelToken &token = PipeCancelToken());
+	PipeCancelToken token() const;
 };
 
 class PipeStageExec: public PipeHeadExec {
@@ -103,6 +259,7 @@ private:
 	static void run_thread(PipeHeadExec *th);
 	virtual void run() override;
 	virtual void *next() override final;
+	void *invoke_next(void *arg);
 protected:
 	virtual void *next(void *arg) = 0;
 public:
@@ -117,6 +274,13 @@ class PipeOutputIterator {
 protected:
 	PipeStageExec &tail;
 	void *value;
+	// the chunk we are walking through
+	std::vector<void*> chunk;
+	size_t pos;
+	// this chunk is the last one
+	bool last;
+	bool at_end;
+	void fetch();
 	PipeOutputIterator &seek_begin();
 	PipeOutputIterator &seek_end();
 public:
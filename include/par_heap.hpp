@@ -0,0 +1,174 @@
+#ifndef __PAR_HEAP_HH__
+#define __PAR_HEAP_HH__
+
+/**
+ * Parallel heap construction and sorting on top of ParallelExec
+ * @author Denis Kokarev
+ */
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include "par.hpp"
+#include "heap.hpp"
+
+/**
+ * heapify() - the subtrees rooted at some level L of the heap are independent,
+ * so they are heapified concurrently, each slice takes a contiguous range of
+ * subtree roots. Within a range the nodes of every depth are contiguous too,
+ * so each slice walks its own block level by level bottom-up. The remaining
+ * top L levels are sifted sequentially. Same min-heap as heapify() from heap.hpp
+ *
+ * sort() - the same inverted order as heapsort(), greatest element first.
+ * Every slice heapsorts its own block in place, then the sorted runs are merged
+ * pairwise in log2(nthreads) rounds through a buffer of the same size.
+ * Both phases are O(N log N) in the worst case.
+ *
+ * Small inputs and single thread fall back to heap.hpp functions.
+ * Elements are ordered by cmp(proj(a), proj(b))
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> class ParHeap: public ParallelExec {
+	typedef typename std::iterator_traits<TI>::difference_type diff_t;
+	typedef typename std::iterator_traits<TI>::value_type value_t;
+	Cmp cmp;
+	Proj proj;
+	// use parallel path starting from this size
+	static constexpr diff_t min_par_size = 1<<14;
+	// at least this many subtrees per slice to balance the ragged last level
+	static constexpr diff_t subtrees_per_slice = 8;
+	enum Phase {
+		HEAPIFY,
+		SORT,
+		MERGE,
+		COPY
+	} phase;
+	TI begin;
+	diff_t sz;
+	// heapify: subtree roots level
+	diff_t level_first, level_cnt;
+	// sort: sorted runs [bnd[i], bnd[i+1])
+	std::vector<diff_t> bnd;
+	std::vector<value_t> buf;
+	// sorted runs reside in buf
+	bool in_buf;
+	// merge runs n and n+width
+	int width;
+	void heapify_slice(int n) {
+		size_t lo, hi;
+		slice_block(n, level_cnt, lo, hi);
+		const diff_t last = sz/2; // nodes [0, last) have children
+		const diff_t rlo = level_first+lo, rhi = level_first+hi;
+		diff_t d = 0;
+		while (((rlo+1)<<(d+1))-1 < last)
+			d++;
+		for (; d>=0; d--) {
+			diff_t b = ((rlo+1)<<d)-1;
+			diff_t e = std::min(((rhi+1)<<d)-1, last);
+			for (diff_t i=e-1; i>=b; i--)
+				sift_node(i, begin, sz, cmp, proj);
+		}
+	}
+	template<class SI, class DI> void merge_runs(int n, SI src, DI dst) {
+		int p = bnd.size()-1;
+		diff_t lo = bnd[n];
+		diff_t mid = bnd[std::min(n+width, p)];
+		diff_t hi = bnd[std::min(n+2*width, p)];
+		std::merge(src+lo, src+mid, src+mid, src+hi, dst+lo, [this](const value_t &a, const value_t &b) {
+			return cmp(proj(b), proj(a));
+		});
+	}
+	virtual void exec_slice(int n) override {
+		switch (phase) {
+		case HEAPIFY:
+			heapify_slice(n);
+			break;
+		case SORT:
+			if (bnd[n] < bnd[n+1])
+				::heapsort(begin+bnd[n], begin+bnd[n+1], cmp, proj);
+			break;
+		case MERGE:
+			if (n % (2*width) == 0) {
+				if (in_buf)
+					merge_runs(n, buf.begin(), begin);
+				else
+					merge_runs(n, begin, buf.begin());
+			}
+			break;
+		case COPY:
+			std::copy(buf.begin()+bnd[n], buf.begin()+bnd[n+1], begin+bnd[n]);
+			break;
+		}
+	}
+public:
+	ParHeap(int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()):ParallelExec(nthreads),cmp(cmp),proj(proj) {
+	}
+	/**
+	 * Turn [begin, end) into min-heap
+	 */
+	void heapify(TI b, TI e) {
+		begin = b;
+		sz = e-b;
+		level_cnt = 1;
+		while (level_cnt < subtrees_per_slice*nthreads)
+			level_cnt <<= 1;
+		level_first = level_cnt-1;
+		// subtree roots must have children
+		if (nthreads < 2 || sz < min_par_size || 2*level_first+1 >= sz) {
+			if (sz > 0)
+				::heapify(b, e, cmp, proj);
+			return;
+		}
+		phase = HEAPIFY;
+		exec();
+		for (diff_t r=level_first-1; r>=0; r--)
+			sift_node(r, begin, sz, cmp, proj);
+	}
+	/**
+	 * Inverted sort of [begin, end), greatest element first
+	 */
+	void sort(TI b, TI e) {
+		begin = b;
+		sz = e-b;
+		if (nthreads < 2 || sz < min_par_size) {
+			if (sz > 0)
+				::heapsort(b, e, cmp, proj);
+			return;
+		}
+		bnd.resize(nthreads+1);
+		for (int n=0; n<nthreads; n++) {
+			size_t lo, hi;
+			slice_block(n, sz, lo, hi);
+			bnd[n] = lo;
+		}
+		bnd[nthreads] = sz;
+		phase = SORT;
+		exec();
+		buf.resize(sz);
+		in_buf = false;
+		phase = MERGE;
+		for (width=1; width<nthreads; width*=2) {
+			exec();
+			in_buf = !in_buf;
+		}
+		if (in_buf) {
+			phase = COPY;
+			exec();
+		}
+	}
+};
+
+/**
+ * Parallel heapify() on a temporary thread pool
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> void par_heapify(TI begin, TI end, int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()) {
+	ParHeap<TI, Cmp, Proj>(nthreads, cmp, proj).heapify(begin, end);
+}
+
+/**
+ * Parallel inverted sort on a temporary thread pool, greatest element first
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> void par_heapsort(TI begin, TI end, int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()) {
+	ParHeap<TI, Cmp, Proj>(nthreads, cmp, proj).sort(begin, end);
+}
+
+#endif // __PAR_HEAP_HH__
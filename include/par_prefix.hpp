@@ -0,0 +1,40 @@
+#ifndef __PAR_PREFIX_HH__
+#define __PAR_PREFIX_HH__
+
+/**
+ * Parallel substring search on top of ParallelExec
+ * @author Denis Kokarev
+ */
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include "par.hpp"
+#include "prefix.hpp"
+
+/**
+ * KMP search of all matches over a ParallelExec pool
+ * Slice n owns the match positions of its slice_block() of the text and
+ * scans the block extended by size()-1 bytes of overlap, so a match crossing
+ * the boundary is found once by the slice where it starts. The slices'
+ * matches are then copied in order to their offsets in the output
+ */
+class ParKmp: public ParallelExec {
+	const KmpPattern *pattern;
+	const char *text;
+	size_t sz;
+	std::vector<size_t> *res;
+	std::vector<std::vector<size_t>> found;
+	std::vector<size_t> base;
+	bool copy;
+protected:
+	virtual void exec_slice(int n) override;
+public:
+	ParKmp(int nthreads = std::max(1U, std::thread::hardware_concurrency()));
+	/**
+	 * all match positions of pattern in [begin, end) in ascending order,
+	 * same as KmpPattern::each()
+	 */
+	void find_all(const KmpPattern &pattern, const char *begin, const char *end, std::vector<size_t> &res);
+};
+
+#endif // __PAR_PREFIX_HH__
@@ -0,0 +1,82 @@
+#ifndef __PAR_PRIME_HH__
+#define __PAR_PRIME_HH__
+
+/**
+ * Parallel prime sieving and factorization on top of ParallelExec
+ * @author Denis Kokarev
+ */
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include "par.hpp"
+#include "prime.hpp"
+
+/**
+ * Multithreaded segmented sieve on a ParallelExec pool
+ * each() walks [lo, hi) in rounds, in every round each thread sieves its own
+ * window of window_bytes*30 numbers, then the windows are passed to the
+ * callback in order. count() splits the range evenly between the threads
+ * and only counts the primes
+ */
+class ParPrimeSieve: public ParallelExec {
+	uint64_t lo, hi;
+	// start of the next round
+	uint64_t pos;
+	bool counting;
+	std::vector<uint32_t> sprimes;
+	std::vector<std::vector<uint64_t>> found;
+	std::vector<uint64_t> counts;
+	void prepare(uint64_t lo, uint64_t hi);
+	void slice_range(int n, uint64_t &a, uint64_t &b) const;
+	// sieve the next round of windows, false when the range is exhausted
+	bool next_round();
+protected:
+	virtual void exec_slice(int n) override;
+public:
+	static constexpr uint64_t window_bytes = 16*PrimeSegmentSieve::segment_bytes;
+	ParPrimeSieve(int nthreads = std::max(1U, std::thread::hardware_concurrency()));
+	/**
+	 * Invoke f(p) for every prime p in [lo, hi) in ascending order
+	 */
+	template<class F> void each(uint64_t lo, uint64_t hi, F f) {
+		prepare(lo, hi);
+		while (next_round())
+			for (auto &w:found)
+				for (uint64_t p:w)
+					f(p);
+	}
+	/**
+	 * Number of primes in [lo, hi)
+	 */
+	uint64_t count(uint64_t lo, uint64_t hi);
+};
+
+/**
+ * Parallel batch factorization with SpfTable
+ * All prime factors (with repetitions) of in[i] are placed to
+ * factors[offsets[i]..offsets[i+1]) in ascending order
+ */
+class ParFactor: public ParallelExec {
+	const SpfTable &table;
+	const uint32_t *in;
+	size_t sz;
+	std::vector<uint32_t> *factors;
+	std::vector<size_t> *offsets;
+	// slice's own results before they are copied to the flat buffer
+	std::vector<std::vector<uint32_t>> part;
+	std::vector<size_t> base;
+	bool copy;
+protected:
+	virtual void exec_slice(int n) override;
+public:
+	ParFactor(const SpfTable &table, int nthreads = std::max(1U, std::thread::hardware_concurrency()));
+	/**
+	 * @param in, sz - numbers to factorize, each of them in [1, table.size())
+	 * @param factors - flat output buffer
+	 * @param offsets - sz+1 offsets into factors
+	 */
+	void factor(const uint32_t *in, size_t sz, std::vector<uint32_t> &factors, std::vector<size_t> &offsets);
+};
+
+#endif // __PAR_PRIME_HH__
@@ -0,0 +1,202 @@
+#ifndef __PAR_SELECT_HH__
+#define __PAR_SELECT_HH__
+
+/**
+ * Parallel 3-way partition and selection on top of ParallelExec
+ * @author Denis Kokarev
+ */
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <cassert>
+#include "par.hpp"
+#include "partition.hpp"
+#include "nth_element.hpp"
+
+/**
+ * partition() - every slice 3-way partitions its own block in place and counts
+ * its less, equal and greater elements. Prefix sums of the counts give every
+ * slice the destinations of its three parts, the parts are moved to a scratch
+ * buffer of the same size and then copied back, each slice copying its block.
+ *
+ * nth_element() - introselect with ninther pivots where every partition is
+ * parallel. Once the range is small or the pivots keep going bad it finishes
+ * with introselect() from nth_element.hpp, so the worst case stays O(N).
+ *
+ * percentiles() - selects several ranks at once, each selection splits the
+ * range for the ranks on both sides of it.
+ *
+ * Small inputs and single thread fall back to the sequential functions.
+ * Elements are ordered by cmp(proj(a), proj(b))
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> class ParSelect: public ParallelExec {
+	typedef typename std::iterator_traits<TI>::value_type value_t;
+	// use parallel path starting from this size
+	static constexpr size_t min_par_size = 1<<16;
+	Cmp cmp;
+	Proj proj;
+	enum Phase {
+		CLASSIFY,
+		MOVE,
+		COPY
+	} phase;
+	TI begin;
+	size_t sz;
+	const value_t *pivot;
+	// per slice counts of less and equal elements and destinations of its parts
+	std::vector<size_t> cnt_lt, cnt_eq;
+	std::vector<size_t> dst_lt, dst_eq, dst_gt;
+	std::vector<value_t> buf;
+	virtual void exec_slice(int n) override {
+		size_t lo, hi;
+		slice_block(n, sz, lo, hi);
+		switch (phase) {
+		case CLASSIFY: {
+			Range r = partition3way_block(begin+lo, begin+hi, *pivot, cmp, proj);
+			cnt_lt[n] = r.begin;
+			cnt_eq[n] = r.end-r.begin;
+			break;
+		}
+		case MOVE: {
+			TI b = begin+lo;
+			const size_t lt = cnt_lt[n], eq = cnt_eq[n];
+			std::move(b, b+lt, buf.begin()+dst_lt[n]);
+			std::move(b+lt, b+lt+eq, buf.begin()+dst_eq[n]);
+			std::move(b+lt+eq, begin+hi, buf.begin()+dst_gt[n]);
+			break;
+		}
+		case COPY:
+			std::move(buf.begin()+lo, buf.begin()+hi, begin+lo);
+			break;
+		}
+	}
+	// select sorted ranks [rb..re) of b within [l..r)
+	void multi_select(TI b, size_t l, size_t r, const size_t *rb, const size_t *re) {
+		if (rb >= re)
+			return;
+		const size_t *mid = rb+(re-rb)/2;
+		nth_element(b+l, b+*mid, b+r);
+		multi_select(b, l, *mid, rb, mid);
+		multi_select(b, *mid+1, r, mid+1, re);
+	}
+public:
+	ParSelect(int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()):ParallelExec(nthreads),
+		cmp(cmp),proj(proj),cnt_lt(nthreads),cnt_eq(nthreads),dst_lt(nthreads),dst_eq(nthreads),dst_gt(nthreads) {
+	}
+	/**
+	 * 3-way partition of [b..e) around pivot value
+	 * @return Range (b,e) of offsets from b, where [0..b) < pivot, [b..e) == pivot and [e..end-b) > pivot
+	 */
+	Range partition(TI b, TI e, const value_t &pv) {
+		begin = b;
+		sz = e-b;
+		if (nthreads < 2 || sz < min_par_size)
+			return partition3way_block(b, e, pv, cmp, proj);
+		pivot = &pv;
+		phase = CLASSIFY;
+		exec();
+		size_t lt = 0, eq = 0;
+		for (int n=0; n<nthreads; n++) {
+			lt += cnt_lt[n];
+			eq += cnt_eq[n];
+		}
+		size_t to_lt = 0, to_eq = lt, to_gt = lt+eq;
+		for (int n=0; n<nthreads; n++) {
+			size_t lo, hi;
+			slice_block(n, sz, lo, hi);
+			dst_lt[n] = to_lt;
+			dst_eq[n] = to_eq;
+			dst_gt[n] = to_gt;
+			to_lt += cnt_lt[n];
+			to_eq += cnt_eq[n];
+			to_gt += hi-lo-cnt_lt[n]-cnt_eq[n];
+		}
+		if (buf.size() < sz)
+			buf.resize(sz);
+		phase = MOVE;
+		exec();
+		phase = COPY;
+		exec();
+		return Range {lt, lt+eq};
+	}
+	/**
+	 * same as partition3way(), end[-1] is a pivot
+	 * expecting (e-b) > 0
+	 */
+	Range partition3way(TI b, TI e) {
+		const value_t pv = e[-1];
+		return partition(b, e, pv);
+	}
+	/**
+	 * place nth where it would be in sorted [b..e)
+	 */
+	void nth_element(TI b, TI nth, TI e) {
+		const size_t k = nth-b;
+		size_t l = 0, r = e-b;
+		int bad_partitions = 4;
+		while (k < r && r-l >= min_par_size && nthreads > 1 && bad_partitions > 0) {
+			const size_t n = r-l;
+			TI sb = b+l;
+			const value_t pv = sb[select_ninther(sb, n, cmp, proj)];
+			Range range = partition(sb, sb+n, pv);
+			if (k < l+range.begin) {
+				r = l+range.begin;
+			} else if (k >= l+range.end) {
+				l += range.end;
+			} else {
+				return;
+			}
+			if (4*(r-l) > 3*n)
+				bad_partitions--;
+		}
+		introselect(b+l, nth, b+r, cmp, proj);
+	}
+	/**
+	 * Values of several percentiles of [b..e) in one call, p = 0.5 is the median,
+	 * the element of rank floor(p*(e-b-1)) is taken for p from [0, 1].
+	 * The ranks are placed where they would be in sorted [b..e)
+	 * expecting (e-b) > 0, every p within [0, 1] and cmp to be a strict weak
+	 * order on the projected keys, so no NaN among floating point keys
+	 */
+	void percentiles(TI b, TI e, const std::vector<double> &ps, std::vector<value_t> &out) {
+		const size_t n = e-b;
+		std::vector<size_t> ranks(ps.size());
+		for (size_t i=0; i<ps.size(); i++) {
+			assert(ps[i] >= 0 && ps[i] <= 1);
+			ranks[i] = std::min(n-1, size_t(ps[i]*(n-1)));
+		}
+		std::vector<size_t> sorted(ranks);
+		std::sort(sorted.begin(), sorted.end());
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+		multi_select(b, 0, n, sorted.data(), sorted.data()+sorted.size());
+		out.clear();
+		for (size_t k:ranks)
+			out.push_back(b[k]);
+	}
+};
+
+/**
+ * Parallel 3-way partition on a temporary thread pool, end[-1] is a pivot
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> Range par_partition3way(TI begin, TI end, int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()) {
+	return ParSelect<TI, Cmp, Proj>(nthreads, cmp, proj).partition3way(begin, end);
+}
+
+/**
+ * Parallel nth_element on a temporary thread pool
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> void par_nth_element(TI begin, TI nth, TI end, int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()) {
+	ParSelect<TI, Cmp, Proj>(nthreads, cmp, proj).nth_element(begin, nth, end);
+}
+
+/**
+ * Several percentiles in one call on a temporary thread pool, see ParSelect::percentiles()
+ */
+template<class TI, class Cmp = Less, class Proj = Identity> std::vector<typename std::iterator_traits<TI>::value_type> par_percentiles(TI begin, TI end, const std::vector<double> &ps, int nthreads = std::max(1U, std::thread::hardware_concurrency()), Cmp cmp = Cmp(), Proj proj = Proj()) {
+	std::vector<typename std::iterator_traits<TI>::value_type> out;
+	ParSelect<TI, Cmp, Proj>(nthreads, cmp, proj).percentiles(begin, end, ps, out);
+	return out;
+}
+
+#endif // __PAR_SELECT_HH__
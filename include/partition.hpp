@@ -1,27 +1,112 @@
 #ifndef __PARTITION_HH__
 #define __PARTITION_HH__
 
+#include <cstddef>
 #include <vector>
+#include <iterator>
+#include <utility>
+#include "compare.hpp"
 
 struct Range {
 	size_t begin, end;
 };
 
-// rearrangle [l..r] section of vector vv where vv[r] is considered a pivot element
+// rearrangle [begin..end) section where end[-1] is considered a pivot element
 // first we have elements less than pivot, then equal to pivot and then greader than pivot
-// @return Range (b,e), where vv[l..b-1) < pivot, vv[b..e) == pivot and vv[e..r] > pivot
-template<class T> Range partition3way(std::vector<T> &vv, size_t l, size_t r) {
-	size_t mid = l;
-	const T pivot = vv[r];
+// elements are ordered by cmp(proj(a), proj(b))
+// expecting (end-begin) > 0
+// @return Range (b,e) of offsets from begin, where [0..b) < pivot, [b..e) == pivot and [e..end-begin) > pivot
+template<class TI, class Cmp = Less, class Proj = Identity> Range partition3way(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	size_t l = 0, mid = 0, r = end-begin-1;
+	const typename std::iterator_traits<TI>::value_type pivot = begin[r];
 	while (mid <= r) {
-		if (vv[mid] < pivot)
-			std::swap(vv[l++], vv[mid++]);
-		else if (pivot < vv[mid])
-			std::swap(vv[mid], vv[r--]);
+		if (cmp(proj(begin[mid]), proj(pivot)))
+			std::swap(begin[l++], begin[mid++]);
+		else if (cmp(proj(pivot), proj(begin[mid])))
+			std::swap(begin[mid], begin[r--]);
 		else
 			mid++;
 	}
 	return Range {l, mid};
 }
 
+// rearrangle [l..r] section of vector vv where vv[r] is considered a pivot element
+// first we have elements less than pivot, then equal to pivot and then greader than pivot
+// @return Range (b,e), where vv[l..b-1) < pivot, vv[b..e) == pivot and vv[e..r] > pivot
+template<class T, class Cmp = Less, class Proj = Identity> Range partition3way(std::vector<T> &vv, size_t l, size_t r, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	Range range = partition3way(vv.begin()+l, vv.begin()+r+1, cmp, proj);
+	return Range {l+range.begin, l+range.end};
+}
+
+// move elements satisfying pred to the front of [first..last), BlockQuicksort scheme:
+// both ends are scanned in blocks of 64 and the offsets of misplaced elements are
+// collected without branches, then the misplaced pairs are swapped
+// @return number of elements satisfying pred
+template<class TI, class Pred> size_t block_partition(TI first, TI last, Pred pred) {
+	constexpr int block = 64;
+	unsigned char offl[block], offr[block];
+	int numl = 0, numr = 0, startl = 0, startr = 0;
+	TI l = first, r = last;
+	while (r-l > 2*block) {
+		if (numl == 0) {
+			startl = 0;
+			for (int i=0; i<block; i++) {
+				offl[numl] = i;
+				numl += !pred(l[i]);
+			}
+		}
+		if (numr == 0) {
+			startr = 0;
+			for (int i=0; i<block; i++) {
+				offr[numr] = i;
+				numr += pred(r[-1-i]);
+			}
+		}
+		const int n = numl < numr ? numl : numr;
+		for (int j=0; j<n; j++)
+			std::swap(l[offl[startl+j]], r[-1-offr[startr+j]]);
+		numl -= n;
+		numr -= n;
+		startl += n;
+		startr += n;
+		if (numl == 0)
+			l += block;
+		if (numr == 0)
+			r -= block;
+	}
+	// everything left of l satisfies pred and right of r does not, finish in place
+	for (;;) {
+		while (l < r && pred(*l))
+			++l;
+		while (l < r && !pred(r[-1]))
+			--r;
+		if (r-l < 2)
+			break;
+		std::swap(*l, r[-1]);
+		++l;
+		--r;
+	}
+	return l-first;
+}
+
+// same as below around a given pivot value, the pivot does not have to be in
+// [begin..end) and must not refer to an element of it, since elements are moved
+template<class TI, class Cmp, class Proj> Range partition3way_block(TI begin, TI end, const typename std::iterator_traits<TI>::value_type &pivot, Cmp cmp, Proj proj) {
+	const size_t lt = block_partition(begin, end, [&](const typename std::iterator_traits<TI>::value_type &v) {
+		return cmp(proj(v), proj(pivot));
+	});
+	const size_t eq = block_partition(begin+lt, end, [&](const typename std::iterator_traits<TI>::value_type &v) {
+		return !cmp(proj(pivot), proj(v));
+	});
+	return Range {lt, lt+eq};
+}
+
+// same as partition3way() with end[-1] as a pivot and the same Range result, but
+// without the three-way branch per element: block_partition() separates elements
+// less than pivot, then the rest is split into equal and greater
+template<class TI, class Cmp = Less, class Proj = Identity> Range partition3way_block(TI begin, TI end, Cmp cmp = Cmp(), Proj proj = Proj()) {
+	const typename std::iterator_traits<TI>::value_type pivot = end[-1];
+	return partition3way_block(begin, end, pivot, cmp, proj);
+}
+
 #endif // __PARTITION_HH__
@@ -0,0 +1,378 @@
+#ifndef __PIPE_HH__
+#define __PIPE_HH__
+
+/**
+ * Typed parallel conveyor primitives
+ * @author Denis Kokarev
+ */
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <utility>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Bounded single-producer/single-consumer ring buffer.
+ * push() and pop() are lock-free on the fast path. When the ring is
+ * full (empty) the producer (consumer) spins for a while and then goes
+ * to sleep on a condition variable until the other side makes progress.
+ * Items are moved in and moved out, T must be default-constructible and
+ * move-assignable.
+ *
+ * close() is called by producer when no more items will come, consumer
+ * still drains the remaining items.
+ * cancel() is called by either side to abort the exchange, both push()
+ * and pop() fail right away.
+ */
+template<class T> class SpscQueue {
+	static constexpr int spin_limit = 64;
+	static constexpr size_t cache_line = 64;
+	std::unique_ptr<T[]> buf;
+	size_t mask;
+	// consumer and producer positions live on separate cache lines
+	char pad0[cache_line];
+	std::atomic<size_t> rd;
+	char pad1[cache_line];
+	std::atomic<size_t> wr;
+	char pad2[cache_line];
+	std::atomic<bool> closed;
+	std::atomic<bool> cancelled;
+	// sleeping side waits here
+	std::atomic<int> sleepers;
+	std::mutex mtx;
+	std::condition_variable cv;
+	static size_t round_up(size_t n) {
+		size_t p = 1;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+	template<class P> void wait(int &spin, P ready) {
+		if (spin < spin_limit) {
+			spin++;
+			std::this_thread::yield();
+		} else {
+			std::unique_lock<std::mutex> lck(mtx);
+			sleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!ready())
+				cv.wait(lck);
+			sleepers.fetch_sub(1);
+		}
+	}
+	void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> lck(mtx);
+			cv.notify_all();
+		}
+	}
+	bool can_push(size_t w) const {
+		return w-rd.load(std::memory_order_acquire) <= mask || cancelled.load(std::memory_order_acquire);
+	}
+	bool can_pop(size_t r) const {
+		return r != wr.load(std::memory_order_acquire) || closed.load(std::memory_order_acquire) || cancelled.load(std::memory_order_acquire);
+	}
+public:
+	/**
+	 * @param depth - ring capacity, rounded up to the power of 2
+	 */
+	SpscQueue(size_t depth):buf(new T[round_up(depth)]),mask(round_up(depth)-1),rd(0),wr(0),closed(false),cancelled(false),sleepers(0) {
+	}
+	/**
+	 * Move v into the queue, blocks while the queue is full
+	 * @return false if queue was cancelled
+	 */
+	bool push(T &&v) {
+		size_t w = wr.load(std::memory_order_relaxed);
+		for (int spin=0; !can_push(w);)
+			wait(spin, [&]{ return can_push(w); });
+		if (cancelled.load(std::memory_order_acquire))
+			return false;
+		buf[w&mask] = std::move(v);
+		wr.store(w+1, std::memory_order_release);
+		wake();
+		return true;
+	}
+	/**
+	 * Move the next item into v, blocks while the queue is empty
+	 * @return false if queue was cancelled or closed and drained
+	 */
+	bool pop(T &v) {
+		size_t r = rd.load(std::memory_order_relaxed);
+		for (int spin=0; !can_pop(r);)
+			wait(spin, [&]{ return can_pop(r); });
+		if (cancelled.load(std::memory_order_acquire) || r == wr.load(std::memory_order_acquire))
+			return false;
+		v = std::move(buf[r&mask]);
+		rd.store(r+1, std::memory_order_release);
+		wake();
+		return true;
+	}
+	/**
+	 * Producer has no more items
+	 */
+	void close() {
+		closed.store(true, std::memory_order_release);
+		std::lock_guard<std::mutex> lck(mtx);
+		cv.notify_all();
+	}
+	/**
+	 * Abort the exchange, wake up both sides
+	 */
+	void cancel() {
+		cancelled.store(true, std::memory_order_release);
+		std::lock_guard<std::mutex> lck(mtx);
+		cv.notify_all();
+	}
+};
+
+/**
+ * Hand-over point between the replicas of one conveyor element (producers)
+ * and the replicas of the next one (consumers).
+ *
+ * Ordered mode keeps a separate SpscQueue lane for every producer/consumer
+ * pair. Items are dealt round-robin by their sequence number s: producer s%producers
+ * makes item s and consumer s%consumers takes it. So the order is preserved
+ * and no locks are needed.
+ *
+ * Relaxed mode uses a single queue, producers and consumers take turns on
+ * their own side under a mutex, whichever replica is free takes the next item.
+ * Item order is not preserved.
+ */
+template<class T> class PipeChannel {
+	size_t depth;
+	int producers;
+	int consumers;
+	bool ordered;
+	std::vector<std::unique_ptr<SpscQueue<T>>> lanes;
+	// relaxed mode only
+	std::mutex push_mtx;
+	std::mutex pop_mtx;
+	std::atomic<int> open;
+public:
+	PipeChannel(size_t depth):depth(depth),producers(1),consumers(1),ordered(true),open(1) {
+		lanes.emplace_back(new SpscQueue<T>(depth));
+	}
+	/**
+	 * Must be called before any producer or consumer starts
+	 */
+	void setup(int nproducers, int nconsumers, bool is_ordered) {
+		producers = nproducers;
+		consumers = nconsumers;
+		ordered = is_ordered;
+		open = producers;
+		lanes.clear();
+		int nlanes = ordered ? producers*consumers : 1;
+		for (int i=0; i<nlanes; i++)
+			lanes.emplace_back(new SpscQueue<T>(depth));
+	}
+	/**
+	 * Producer p pushes its j-th item
+	 */
+	bool push(int p, size_t j, T &&v) {
+		if (ordered) {
+			size_t s = p+j*producers;
+			return lanes[p*consumers+s%consumers]->push(std::move(v));
+		} else if (producers > 1) {
+			std::lock_guard<std::mutex> lck(push_mtx);
+			return lanes[0]->push(std::move(v));
+		} else {
+			return lanes[0]->push(std::move(v));
+		}
+	}
+	/**
+	 * Consumer c pops its j-th item
+	 */
+	bool pop(int c, size_t j, T &v) {
+		if (ordered) {
+			size_t s = c+j*consumers;
+			return lanes[s%producers*consumers+c]->pop(v);
+		} else if (consumers > 1) {
+			std::lock_guard<std::mutex> lck(pop_mtx);
+			return lanes[0]->pop(v);
+		} else {
+			return lanes[0]->pop(v);
+		}
+	}
+	/**
+	 * Producer p has no more items
+	 */
+	void close(int p) {
+		if (ordered) {
+			for (int c=0; c<consumers; c++)
+				lanes[p*consumers+c]->close();
+		} else if (--open == 0) {
+			lanes[0]->close();
+		}
+	}
+	void cancel() {
+		for (auto &l:lanes)
+			l->cancel();
+	}
+};
+
+/**
+ * Typed parallel conveyor primitives
+ * PipeHead<A> > PipeStage<A,B> > PipeStage<B,C> > PipeSink<C> -> PipeSinkIterator<C>
+ *
+ * Unlike PipeHeadExec/PipeStageExec from par.hpp the elements are not advanced
+ * in lock-step. Every element runs in its own thread and hands its results over
+ * to the next one through bounded SpscQueues of configurable depth. Therefore
+ * each stage runs at its own rate and the results are moved from stage to stage,
+ * so there is no need to keep several rotating copies of them.
+ *
+ * PipeHead<T> requires overloading bool next(T &out) method which fills the
+ * next result and returns false when there is no more data
+ *
+ * PipeStage<IN,OUT> requires overloading OUT next(IN &&arg) method
+ *
+ * A slow stage may be declared with several replicas. Then its next() is
+ * executed concurrently by that many threads and must be reentrant.
+ * An ordered stage delivers results in the order of its input, a relaxed one
+ * delivers them as soon as they are ready, which balances uneven items better.
+ *
+ * PipeSink<T> is used to obtain PipeSinkIterator<T> which yields the
+ * results of the last stage
+ *
+ * The threads of every element are started by its consumer, i.e. the next
+ * stage or sink, and are joined when the consumer is destroyed
+ */
+template<class IN, class OUT> class PipeStage;
+template<class T> class PipeSink;
+template<class T> class PipeSinkIterator;
+
+template<class T> class PipeHead {
+	template<class I, class O> friend class PipeStage;
+	friend PipeSink<T>;
+	friend PipeSinkIterator<T>;
+private:
+	PipeChannel<T> out;
+	static void run_thread(PipeHead *th, int r) {
+		th->run(r);
+	}
+	virtual void run(int r) {
+		T v;
+		for (size_t j=0; next(v); j++)
+			if (!out.push(r, j, std::move(v)))
+				break;
+		out.close(r);
+	}
+	virtual void cancel() {
+		out.cancel();
+	}
+	// consumer starts our replicas
+	// @return true if items are handed over in order
+	bool start(std::vector<std::thread> &threads, int consumers, bool consumer_ordered) {
+		bool in_order = ordered && consumer_ordered;
+		out.setup(replicas, consumers, in_order);
+		for (int r=0; r<replicas; r++)
+			threads.emplace_back(run_thread, this, r);
+		return in_order;
+	}
+protected:
+	const int replicas;
+	// a stage fed out of order cannot deliver in order
+	bool ordered;
+	virtual bool next(T &out) = 0;
+	PipeHead(size_t depth, int replicas, bool ordered):out(depth),replicas(replicas),ordered(ordered) {
+	}
+public:
+	/**
+	 * @param depth - how many results may be queued up for the next stage
+	 */
+	PipeHead(size_t depth = 16):PipeHead(depth, 1, true) {
+	}
+	virtual ~PipeHead() {
+	}
+};
+
+template<class IN, class OUT> class PipeStage: public PipeHead<OUT> {
+private:
+	PipeHead<IN> &parent;
+	std::vector<std::thread> threads;
+	virtual void run(int r) override {
+		IN arg;
+		for (size_t j=0; parent.out.pop(r, j, arg); j++)
+			if (!this->out.push(r, j, next(std::move(arg))))
+				break;
+		this->out.close(r);
+	}
+	virtual void cancel() override {
+		this->out.cancel();
+		parent.cancel();
+	}
+	virtual bool next(OUT &) override final {
+		return false;
+	}
+protected:
+	virtual OUT next(IN &&arg) = 0;
+public:
+	/**
+	 * @param parent - previous conveyor element
+	 * @param depth - how many results may be queued up for the next stage
+	 * @param replicas - how many threads run this stage
+	 * @param ordered - preserve the order of items
+	 */
+	PipeStage(PipeHead<IN> &parent, size_t depth = 16, int replicas = 1, bool ordered = true):PipeHead<OUT>(depth, replicas, ordered),parent(parent) {
+		this->ordered = parent.start(threads, replicas, ordered);
+	}
+	~PipeStage() {
+		parent.cancel();
+		for (auto &t:threads)
+			t.join();
+	}
+};
+
+template<class T> class PipeSinkIterator {
+	friend PipeSink<T>;
+protected:
+	PipeSink<T> *sink;
+	size_t seq;
+	T value;
+	bool end;
+	PipeSinkIterator(PipeSink<T> *sink, bool end):sink(sink),seq(0),value(),end(end) {
+		if (!end)
+			++*this;
+	}
+public:
+	bool operator==(const PipeSinkIterator &b) const {
+		return end == b.end;
+	}
+	bool operator!=(const PipeSinkIterator &b) const {
+		return end != b.end;
+	}
+	void operator++() {
+		end = !sink->tail.out.pop(0, seq++, value);
+	}
+	T &operator*() {
+		return value;
+	}
+};
+
+template<class T> class PipeSink {
+	friend PipeSinkIterator<T>;
+protected:
+	PipeHead<T> &tail;
+	std::vector<std::thread> threads;
+public:
+	PipeSink(PipeHead<T> &tail):tail(tail) {
+		tail.start(threads, 1, true);
+	}
+	~PipeSink() {
+		tail.cancel();
+		for (auto &t:threads)
+			t.join();
+	}
+	PipeSinkIterator<T> begin() {
+		return PipeSinkIterator<T>(this, false);
+	}
+	PipeSinkIterator<T> end() {
+		return PipeSinkIterator<T>(this, true);
+	}
+};
+
+#endif // __PIPE_HH__
@@ -3,6 +3,10 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "segtree.hpp"
 
 /**
  * KMP prefix function
@@ -10,10 +14,335 @@
  */
 void prefix_function(const std::string &str, std::vector<int> &prefix);
 
+/**
+ * KMP prefix function of [begin, end)
+ * prefix vector should be given in the same size as the range (or greater)
+ */
+void prefix_function(const char *begin, const char *end, std::vector<int> &prefix);
+
+/**
+ * Z-function of [begin, end): z[i] is the length of the longest common
+ * prefix of the string and its suffix starting at i, z[0] is the length
+ * of the string. O(N)
+ * z is resized to the string size
+ */
+void z_function(const char *begin, const char *end, std::vector<int> &z);
+
+/**
+ * Suffix array of [begin, end): starting positions of the suffixes in
+ * lexicographic order of unsigned bytes, a proper prefix goes first.
+ * SA-IS, O(N) time, up to 2^31-1 bytes
+ */
+std::vector<int> suffix_array(const char *begin, const char *end);
+
+/**
+ * Kasai LCP array: lcp[i] is the longest common prefix of the suffixes
+ * sa[i-1] and sa[i], lcp[0] = 0. O(N)
+ */
+std::vector<int> lcp_array(const char *begin, const char *end, const std::vector<int> &sa);
+
+/**
+ * Suffix array with LCP array and its sparse table, the longest common
+ * prefix of any two suffixes is the minimum of LCP between their ranks
+ * O(NlogN) memory, build O(NlogN) time, lcp() query O(1)
+ */
+class SuffixIndex {
+	std::vector<int> sa, rank;
+	SparseTable<int> rmq;
+public:
+	SuffixIndex(const char *begin, const char *end);
+	/**
+	 * suffix array, see suffix_array()
+	 */
+	const std::vector<int> &suffixes() const {
+		return sa;
+	}
+	/**
+	 * position of the suffix i in the suffix array
+	 */
+	int rank_of(int i) const {
+		return rank[i];
+	}
+	/**
+	 * longest common prefix of the suffixes starting at i and j
+	 */
+	int lcp(int i, int j) const {
+		if (i == j)
+			return sa.size()-i;
+		int a = rank[i], b = rank[j];
+		if (a > b)
+			std::swap(a, b);
+		return rmq(a+1, b+1);
+	}
+};
+
+/**
+ * KMP automaton of a key: the prefix function is computed over the key only
+ * and the text is streamed against it, so the text is neither copied nor
+ * needs any extra memory. Any byte including '\0' may appear in the key
+ * and the text
+ */
+class KmpPattern {
+	std::string key;
+	std::vector<int> prefix;
+public:
+	KmpPattern(const char *begin, const char *end);
+	KmpPattern(const std::string &key);
+	size_t size() const {
+		return key.size();
+	}
+	/**
+	 * number of matched key characters after c follows k matched ones, k < size()
+	 */
+	int next(int k, char c) const {
+		while (k > 0 && c != key[k])
+			k = prefix[k-1];
+		return c == key[k] ? k+1 : 0;
+	}
+	/**
+	 * state to continue from after a full match
+	 */
+	int matched() const {
+		return prefix[key.size()-1];
+	}
+	/**
+	 * Invoke f(pos) with every match position in [begin, end), overlapping
+	 * ones included, in ascending order. f returns false to stop the search
+	 * An empty key matches at every position
+	 * @return false when stopped by f
+	 */
+	template<class F> bool each(const char *begin, const char *end, F f) const {
+		const int ksz = key.size();
+		if (ksz == 0) {
+			for (const char *p=begin; p<=end; p++)
+				if (!f(size_t(p-begin)))
+					return false;
+			return true;
+		}
+		int k = 0;
+		for (const char *p=begin; p<end; p++) {
+			k = next(k, *p);
+			if (k == ksz) {
+				if (!f(size_t(p+1-ksz-begin)))
+					return false;
+				k = matched();
+			}
+		}
+		return true;
+	}
+	/**
+	 * first match position in [begin, end) or std::string::npos
+	 */
+	size_t find(const char *begin, const char *end) const;
+};
+
+/**
+ * KMP matcher over a sequence of chunks, e.g. socket reads or file blocks.
+ * The automaton state is kept between feed() calls, so matches spanning
+ * chunk boundaries are found, and their offsets are absolute in the stream
+ * The pattern must outlive the stream, throws std::invalid_argument when it
+ * is empty
+ */
+class KmpStream {
+	const KmpPattern &pattern;
+	// matched key characters
+	int k;
+	// bytes consumed
+	uint64_t pos;
+public:
+	KmpStream(const KmpPattern &pattern):pattern(pattern),k(0),pos(0) {
+		if (pattern.size() == 0)
+			throw std::invalid_argument("KmpStream: empty pattern");
+	}
+	/**
+	 * start a new stream
+	 */
+	void reset() {
+		k = 0;
+		pos = 0;
+	}
+	/**
+	 * bytes consumed so far
+	 */
+	uint64_t offset() const {
+		return pos;
+	}
+	/**
+	 * Invoke f(pos) with the stream offset of every match ending in the chunk,
+	 * f returns false to stop, then the stream resumes right after that match
+	 * @return false when stopped by f
+	 */
+	template<class F> bool feed(const char *chunk, size_t sz, F f) {
+		const int ksz = pattern.size();
+		for (size_t i=0; i<sz; i++) {
+			k = pattern.next(k, chunk[i]);
+			if (k == ksz) {
+				k = pattern.matched();
+				if (!f(pos+i+1-ksz)) {
+					pos += i+1;
+					return false;
+				}
+			}
+		}
+		pos += sz;
+		return true;
+	}
+};
+
+/**
+ * Read-only memory mapping of a whole file
+ * throws std::system_error when the file cannot be opened or mapped
+ */
+class MappedFile {
+	const char *ptr;
+	size_t sz;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+public:
+	MappedFile(const std::string &path);
+	~MappedFile();
+	const char *data() const {
+		return ptr;
+	}
+	size_t size() const {
+		return sz;
+	}
+};
+
+/**
+ * Invoke f(pos) with every match in the file, see KmpPattern::each()
+ * The file is memory-mapped and scanned in place without copying
+ */
+template<class F> bool kmp_scan_file(const std::string &path, const KmpPattern &pattern, F f) {
+	MappedFile file(path);
+	return pattern.each(file.data(), file.data()+file.size(), f);
+}
+
+/**
+ * Aho-Corasick automaton - KMP over a trie of many keys. Failure link of
+ * a node is the longest proper suffix of its string present in the trie,
+ * the same as the prefix function for a single key. All matches of all
+ * keys are reported in one pass over the text
+ * Bytes that occur in no key share class 0, the others are numbered densely.
+ * The transitions are kept in one of two layouts:
+ * DENSE - complete goto table states x classes, failure links are resolved
+ *   at build time, one lookup per text byte
+ * DOUBLE_ARRAY - trie edge s -c-> t is base[s]+c = t, check[t] = s, memory
+ *   proportional to the trie, failure links are followed at scan time
+ * AUTO takes DENSE when its table fits in dense_bytes
+ * Empty keys never match
+ */
+class AhoCorasick {
+public:
+	enum Layout {
+		AUTO,
+		DENSE,
+		DOUBLE_ARRAY
+	};
+	static constexpr size_t dense_bytes = 4*1024*1024;
+private:
+	Layout kind;
+	int classes;
+	uint16_t cls[256];
+	// DENSE: goto[s*classes+c]
+	std::vector<int32_t> dense;
+	// DOUBLE_ARRAY: edges, failure links
+	std::vector<int32_t> base, check, fail;
+	// first entry of the output chain of every state or -1
+	std::vector<int32_t> report;
+	// entry e reports keys out_ids[out_begin[e]..out_begin[e+1]) and continues with out_next[e]
+	std::vector<int32_t> out_begin, out_ids, out_next;
+	std::vector<int32_t> lens;
+	template<class F> bool report_all(int32_t s, size_t end, F &f) const {
+		for (int32_t e=report[s]; e>=0; e=out_next[e])
+			for (int32_t i=out_begin[e]; i<out_begin[e+1]; i++)
+				if (!f(end-lens[out_ids[i]], int(out_ids[i])))
+					return false;
+		return true;
+	}
+public:
+	AhoCorasick(const std::vector<std::string> &keys, Layout layout = AUTO);
+	Layout layout() const {
+		return kind;
+	}
+	/**
+	 * number of automaton states (double array slots for DOUBLE_ARRAY)
+	 */
+	size_t states() const {
+		return report.size();
+	}
+	/**
+	 * memory taken by the automaton
+	 */
+	size_t bytes() const;
+	/**
+	 * Invoke f(pos, key) for every match of every key in [begin, end), ordered
+	 * by the match end, longer keys first for the same end.
+	 * f returns false to stop the search
+	 * @return false when stopped by f
+	 */
+	template<class F> bool each(const char *begin, const char *end, F f) const {
+		int32_t s = 0;
+		if (kind == DENSE) {
+			for (const char *p=begin; p<end; p++) {
+				s = dense[s*classes+cls[uint8_t(*p)]];
+				if (report[s] >= 0 && !report_all(s, p+1-begin, f))
+					return false;
+			}
+			return true;
+		}
+		const int32_t sz = check.size();
+		for (const char *p=begin; p<end; p++) {
+			const int c = cls[uint8_t(*p)];
+			if (c == 0) {
+				s = 0;
+				continue;
+			}
+			for (;;) {
+				int32_t t = base[s]+c;
+				if (t < sz && check[t] == s) {
+					s = t;
+					break;
+				}
+				if (s == 0)
+					break;
+				s = fail[s];
+			}
+			if (report[s] >= 0 && !report_all(s, p+1-begin, f))
+				return false;
+		}
+		return true;
+	}
+};
+
 /**
  * find first substring is a string based on KMP prefix algorithm
- * will use extra memory to construct intermediate string and prefix buffer
+ * the prefix function is built for key only, str is not copied
+ * @return position of key in str or std::string::npos
  */
 size_t kmp_strstr(const std::string &str, const std::string &key);
 
+/**
+ * kmp_strstr() on pointer ranges
+ */
+size_t kmp_strstr(const char *str, size_t sz, const char *key, size_t ksz);
+
+/**
+ * Substring search filtering the candidate positions by the first and
+ * the last key bytes with SIMD, 32 (AVX2) or 16 (SSE2) positions at once,
+ * the survivors are verified by memcmp. The kernel is chosen at runtime by
+ * the CPU features. Periodic keys like "aaa...ab" make verification
+ * expensive, when it exceeds a linear budget the search continues with
+ * KmpPattern, so the worst case stays O(sz+ksz)
+ * @return position of key in str or std::string::npos
+ */
+size_t simd_strstr(const char *str, size_t sz, const char *key, size_t ksz);
+
+size_t simd_strstr(const std::string &str, const std::string &key);
+
+/**
+ * name of the kernel simd_strstr() runs on this CPU: avx2, sse2 or scalar
+ */
+const char *simd_strstr_kernel();
+
 #endif // __PREFIX_HH__
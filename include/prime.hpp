@@ -4,9 +4,18 @@
 #include <cinttypes>
 #include <utility>
 #include <vector>
+#include <cstdint>
+#include <algorithm>
 
 /**
- * Naive prime number factorization in O(sqrt(N))
+ * Deterministic primality test for any 64-bit n (Miller-Rabin)
+ */
+bool is_prime(uint64_t n);
+
+/**
+ * Prime number factorization
+ * Trial division for small factors and small n, then Pollard-rho
+ * with Miller-Rabin for the remaining part of n >= 2^32
  * @param n - number that you want to factorize
  * @param p[] - preallocated recipient array where the of ordered
  *   prime numbers of n will be placed
@@ -17,7 +26,7 @@
 int prime_factors_all(uint64_t n, uint64_t p[]);
 
 /**
- * Naive prime number factorization in O(sqrt(N))
+ * Prime number factorization, see prime_factors_all()
  * @param n - number that you want to factorize
  * @param p[] - preallocated pairs array where the of ordered
  *   prime factors with their respective powers will be placed
@@ -33,4 +42,190 @@ int prime_factors_uniq(uint64_t n, std::pair<uint64_t,int> p[]);
  */
 std::vector<bool> prime_sieve(int n);
 
+/**
+ * Multiplicative functions of MultFuncSieve, combine them with |
+ */
+enum MultFunc {
+	MF_PHI = 1,		// Euler's totient
+	MF_MU = 2,		// Moebius function
+	MF_SIGMA = 4,		// sum of divisors
+	MF_DIVISORS = 8,	// number of divisors
+	MF_ALL = 15
+};
+
+/**
+ * Tables of multiplicative functions on [lo, hi), hi <= 2^32, only the
+ * requested ones are computed and stored. All the functions are 0 at n = 0
+ * Whole table mode - linear sieve on [0, n), every composite is visited once
+ * as its smallest prime times the cofactor, f(n) = f(p^e)*f(n/p^e), O(n).
+ * Segment mode - every number of [lo, hi) is factored by the sieving primes
+ * dividing it, memory is O(hi-lo) plus the primes up to sqrt(hi), use
+ * mult_func_each() to walk a long range in fixed size segments
+ */
+class MultFuncSieve {
+	int funcs;
+	uint64_t lo, hi;
+	std::vector<uint32_t> phi_tbl;
+	std::vector<int8_t> mu_tbl;
+	std::vector<uint64_t> sigma_tbl;
+	std::vector<uint16_t> divisors_tbl;
+	// all the tables filled with 1
+	void alloc(uint64_t sz);
+	void zero(uint64_t i);
+	// f(m) = f(a)*f(b), gcd(a, b) = 1
+	void mul(uint32_t m, uint32_t a, uint32_t b);
+	// f(p*i) from f(i) when i = p^(e-1)
+	void power(uint32_t m, uint32_t i, uint32_t p);
+	// f(i) *= f(pk), pk = p^e
+	void mul_power(uint64_t i, uint32_t p, int e, uint64_t pk);
+public:
+	static constexpr uint32_t segment_size = 1<<16;
+	/**
+	 * Primes up to sqrt(hi) to pass to the segment constructor
+	 */
+	static std::vector<uint32_t> sieving_primes(uint64_t hi);
+	/**
+	 * Whole table for [0, n)
+	 * @param funcs - MultFunc flags
+	 */
+	MultFuncSieve(uint32_t n, int funcs = MF_ALL);
+	/**
+	 * Segment [lo, hi), hi <= 2^32, throws std::out_of_range otherwise
+	 * @param sprimes - sieving_primes() for hi or greater
+	 */
+	MultFuncSieve(uint64_t lo, uint64_t hi, int funcs, const std::vector<uint32_t> &sprimes);
+	uint64_t first() const {
+		return lo;
+	}
+	uint64_t last() const {
+		return hi;
+	}
+	uint32_t phi(uint64_t n) const {
+		return phi_tbl[n-lo];
+	}
+	int mu(uint64_t n) const {
+		return mu_tbl[n-lo];
+	}
+	uint64_t sigma(uint64_t n) const {
+		return sigma_tbl[n-lo];
+	}
+	uint32_t divisors(uint64_t n) const {
+		return divisors_tbl[n-lo];
+	}
+	/**
+	 * memory taken by the tables
+	 */
+	uint64_t bytes() const;
+};
+
+/**
+ * Invoke f(seg) with MultFuncSieve segments covering [lo, hi) in ascending order, hi <= 2^32
+ * throws std::out_of_range otherwise
+ */
+template<class F> void mult_func_each(uint64_t lo, uint64_t hi, int funcs, F f) {
+	auto sprimes = MultFuncSieve::sieving_primes(hi);
+	for (uint64_t a=lo; a<hi; a+=MultFuncSieve::segment_size) {
+		MultFuncSieve seg(a, std::min(a+MultFuncSieve::segment_size, hi), funcs, sprimes);
+		f(static_cast<const MultFuncSieve&>(seg));
+	}
+}
+
+/**
+ * Segmented sieve of Eratosthenes on [lo, hi)
+ * Only the numbers coprime to 30 are stored, 8 of them per byte (2/3/5 wheel),
+ * and the range is sieved in L1-sized segments, so the memory is
+ * O(sqrt(hi)) for the sieving primes regardless of the range length.
+ * Works for hi up to 1e12 and beyond
+ * Call next() to sieve the following segment and obtain its primes, or use
+ * prime_sieve_each() to get a callback for every prime
+ */
+class PrimeSegmentSieve {
+	uint64_t lo, hi;
+	// current segment of bytes [seg_lo, seg_lo+segment_bytes), byte b keeps 30*b+{1,7,11,13,17,19,23,29}
+	uint64_t seg_lo, hi_byte;
+	std::vector<uint8_t> seg;
+	std::vector<uint32_t> sprimes;
+	// for every sieving prime and every wheel residue the byte of its next multiple
+	std::vector<uint64_t> next_mult;
+	std::vector<uint64_t> found;
+	uint64_t sieve();
+public:
+	static constexpr uint64_t segment_bytes = 32*1024;
+	/**
+	 * Primes from 7 to sqrt(hi) needed to sieve up to hi
+	 */
+	static std::vector<uint32_t> sieving_primes(uint64_t hi);
+	PrimeSegmentSieve(uint64_t lo, uint64_t hi);
+	/**
+	 * @param sprimes - sieving_primes() for hi or greater
+	 */
+	PrimeSegmentSieve(uint64_t lo, uint64_t hi, const std::vector<uint32_t> &sprimes);
+	/**
+	 * sieve the next segment
+	 * @return false when the range is exhausted
+	 */
+	bool next();
+	/**
+	 * ordered primes of the last segment
+	 */
+	const std::vector<uint64_t> &primes() const {
+		return found;
+	}
+	/**
+	 * sieve the rest of the range and count its primes without listing them
+	 */
+	uint64_t count();
+};
+
+/**
+ * Invoke f(p) for every prime p in [lo, hi) in ascending order
+ */
+template<class F> void prime_sieve_each(uint64_t lo, uint64_t hi, F f) {
+	PrimeSegmentSieve sieve(lo, hi);
+	while (sieve.next())
+		for (uint64_t p:sieve.primes())
+			f(p);
+}
+
+/**
+ * Number of primes <= n without enumerating them, O(n^3/4) time
+ * and O(sqrt(n)) memory
+ */
+uint64_t prime_pi(uint64_t n);
+
+/**
+ * Smallest prime factor table for fast factorization of n < limit in O(log n)
+ * Built by the linear sieve, every composite is written exactly once.
+ * Even numbers are not stored, so it takes 2 bytes per number below limit
+ */
+class SpfTable {
+	uint32_t limit;
+	// smallest prime factor of 2*i+1
+	std::vector<uint32_t> spf;
+public:
+	/**
+	 * @param limit - factorizable numbers are [1, limit), limit < 2^32
+	 */
+	SpfTable(uint32_t limit);
+	uint32_t size() const {
+		return limit;
+	}
+	/**
+	 * smallest prime factor of 1 < n < limit
+	 */
+	uint32_t smallest(uint32_t n) const {
+		return (n & 1) ? spf[n >> 1] : 2;
+	}
+	/**
+	 * same as prime_factors_all() for n < limit
+	 * @param p[] - p.length >= 32
+	 */
+	int factors_all(uint32_t n, uint32_t p[]) const;
+	/**
+	 * same as prime_factors_uniq() for n < limit
+	 * @param p[] - p.length >= 9
+	 */
+	int factors_uniq(uint32_t n, std::pair<uint32_t,int> p[]) const;
+};
+
 #endif // __PRIME_HH__
@@ -337,4 +337,57 @@ public:
 	}
 };
 
+/**
+ * min() as a fold operation
+ */
+struct FoldMin {
+	template<class T> const T &operator()(const T &a, const T &b) const {
+		return b < a ? b : a;
+	}
+};
+
+/**
+ * Sparse table for static range queries with an idempotent "fold"
+ * (fold(x, x) == x) such as min, max or gcd
+ * Level k keeps folds of all 2^k long segments, a query folds two
+ * overlapping segments covering the range
+ * O(NlogN) space
+ * build - O(NlogN) time
+ * fold() - O(1) time
+ */
+template<class ValueType=int, class FoldOp=FoldMin> class SparseTable {
+	using value_type = ValueType;
+	std::vector<std::vector<value_type>> levels;
+	static int log2(int n) {
+		return 31-__builtin_clz(n);
+	}
+public:
+	/**
+	 * Build on the given values in O(NlogN)
+	 * @param values - values to fold
+	 */
+	SparseTable(const std::vector<value_type> &values):levels(1, values) {
+		const int sz = values.size();
+		for (int k=1; (1<<k)<=sz; k++) {
+			const std::vector<value_type> &prev = levels[k-1];
+			std::vector<value_type> cur(sz-(1<<k)+1);
+			for (size_t i=0; i<cur.size(); i++)
+				cur[i] = FoldOp()(prev[i], prev[i+(1<<(k-1))]);
+			levels.push_back(std::move(cur));
+		}
+	}
+	/**
+	 * Fold non-empty open-ended [b, e) segment in O(1)
+	 * @param b - begin - first element inclusive
+	 * @param e - end - element after last
+	 */
+	value_type operator()(int b, int e) const {
+		const int k = log2(e-b);
+		return FoldOp()(levels[k][b], levels[k][e-(1<<k)]);
+	}
+	int size() const {
+		return levels[0].size();
+	}
+};
+
 #endif //__SEGTREE_HH__
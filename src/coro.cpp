@@ -0,0 +1,76 @@
+/**
+ * @author Denis Kokarev
+ */
+#include "coro.hpp"
+
+/**
+ * Completed task leaves the pool
+ */
+void CoroTask::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+	CoroExecutor *exec = h.promise().exec;
+	h.destroy();
+	exec->task_done();
+}
+
+/**
+ * Small pool of threads multiplexing any number of coroutines.
+ * Coroutines are resumed in FIFO order by whichever thread is free
+ */
+void CoroExecutor::run() {
+	while (true) {
+		std::coroutine_handle<> h;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			while (ready.empty() && !stop)
+				cv_ready.wait(lck);
+			if (ready.empty())
+				break;
+			h = ready.front();
+			ready.pop_front();
+		}
+		h.resume();
+	}
+}
+
+void CoroExecutor::task_done() {
+	std::lock_guard<std::mutex> lck(mtx);
+	if (--tasks == 0)
+		cv_idle.notify_all();
+}
+
+CoroExecutor::CoroExecutor(int nthreads):tasks(0),stop(false) {
+	for (int i=0; i<nthreads; i++)
+		threads.emplace_back(&CoroExecutor::run, this);
+}
+
+CoroExecutor::~CoroExecutor() {
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		stop = true;
+		cv_ready.notify_all();
+	}
+	for (auto &t:threads)
+		t.join();
+}
+
+void CoroExecutor::spawn(CoroTask &&task) {
+	auto h = std::exchange(task.h, nullptr);
+	h.promise().exec = this;
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		tasks++;
+	}
+	schedule(h);
+}
+
+void CoroExecutor::schedule(std::coroutine_handle<> h) {
+	std::lock_guard<std::mutex> lck(mtx);
+	ready.push_back(h);
+	cv_ready.notify_one();
+}
+
+void CoroExecutor::wait() {
+	std::unique_lock<std::mutex> lck(mtx);
+	while (tasks > 0)
+		cv_idle.wait(lck);
+}
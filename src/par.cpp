@@ -2,6 +2,220 @@
  * @author Denis Kokarev
  */
 #include "par.hpp"
+#include <cstdint>
+#include <typeinfo>
+#ifdef YALG_PAR_STATS
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#include <cstdlib>
+#endif
+#endif
+#ifdef YALG_HAVE_AFFINITY
+#include <sched.h>
+#include <pthread.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#endif
+
+#ifdef YALG_HAVE_AFFINITY
+/**
+ * Parse sysfs list like "0-3,8,10-11"
+ */
+static std::vector<int> parse_cpulist(const std::string &str) {
+	std::vector<int> res;
+	std::istringstream is(str);
+	std::string range;
+	while (std::getline(is, range, ',')) {
+		int lo, hi;
+		char dash;
+		std::istringstream rs(range);
+		if (!(rs >> lo))
+			continue;
+		if (rs >> dash >> hi)
+			for (int i=lo; i<=hi; i++)
+				res.push_back(i);
+		else
+			res.push_back(lo);
+	}
+	return res;
+}
+
+static std::string read_line(const std::string &fname) {
+	std::ifstream f(fname);
+	std::string line;
+	std::getline(f, line);
+	return line;
+}
+
+/**
+ * NUMA node of every cpu, 0 if unknown
+ */
+static std::vector<int> cpu_nodes() {
+	std::vector<int> node(CPU_SETSIZE, 0);
+	for (int nd:parse_cpulist(read_line("/sys/devices/system/node/online")))
+		for (int cpu:parse_cpulist(read_line("/sys/devices/system/node/node"+std::to_string(nd)+"/cpulist")))
+			if (cpu < CPU_SETSIZE)
+				node[cpu] = nd;
+	return node;
+}
+
+/**
+ * CPUs this process is allowed to run on
+ */
+static std::vector<int> allowed_cpus() {
+	std::vector<int> res;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &set))
+				res.push_back(cpu);
+	return res;
+}
+
+static bool pin_self(int cpu) {
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#endif // YALG_HAVE_AFFINITY
+
+#ifdef YALG_PAR_STATS
+/**
+ * Instrumentation counters, see par.hpp
+ */
+static std::atomic<int> stats_tid_seq(0);
+
+ParStats::ParStats():tid(++stats_tid_seq),items(0),busy_ns(0),wait_parent_ns(0),wait_child_ns(0) {
+	std::fill(hist, hist+buckets, 0);
+}
+
+uint64_t ParStats::now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ParStats::add_busy(uint64_t start_ns, uint64_t end_ns) {
+	uint64_t d = end_ns-start_ns;
+	items++;
+	busy_ns += d;
+	int b = 0;
+	while (d > 1 && b < buckets-1) {
+		d >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
+/**
+ * Chrome trace, events are only collected between start() and stop()
+ */
+struct TraceEvent {
+	int tid;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+static std::atomic<bool> trace_on(false);
+static std::mutex trace_mtx;
+static std::vector<TraceEvent> trace_events;
+static std::map<int, std::string> trace_names;
+
+static void trace_event(int tid, const std::type_info &ti, int slice, uint64_t start_ns, uint64_t end_ns) {
+	if (!trace_on.load(std::memory_order_relaxed))
+		return;
+	std::lock_guard<std::mutex> lck(trace_mtx);
+	trace_events.push_back(TraceEvent {tid, start_ns, end_ns});
+	if (trace_names.find(tid) == trace_names.end()) {
+		std::string name = ti.name();
+#ifdef __GNUG__
+		int status;
+		char *dm = abi::__cxa_demangle(ti.name(), nullptr, nullptr, &status);
+		if (status == 0)
+			name = dm;
+		free(dm);
+#endif
+		if (slice >= 0)
+			name += " slice " + std::to_string(slice);
+		trace_names[tid] = name;
+	}
+}
+
+void ParTrace::start() {
+	std::lock_guard<std::mutex> lck(trace_mtx);
+	trace_events.clear();
+	trace_names.clear();
+	trace_on = true;
+}
+
+void ParTrace::stop() {
+	trace_on = false;
+}
+
+void ParTrace::dump(std::ostream &os) {
+	std::lock_guard<std::mutex> lck(trace_mtx);
+	uint64_t t0 = trace_events.empty() ? 0 : trace_events[0].start_ns;
+	for (auto &e:trace_events)
+		t0 = std::min(t0, e.start_ns);
+	os << "{\"traceEvents\":[";
+	const char *sep = "\n";
+	for (auto &tn:trace_names) {
+		os << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tn.first << ",\"args\":{\"name\":\"";
+		for (char c:tn.second)
+			if (c == '"' || c == '\\')
+				os << '\\' << c;
+			else
+				os << c;
+		os << "\"}}";
+		sep = ",\n";
+	}
+	for (auto &e:trace_events) {
+		os << sep << "{\"name\":\"next\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid
+		   << ",\"ts\":" << (e.start_ns-t0)/1e3 << ",\"dur\":" << (e.end_ns-e.start_ns)/1e3 << "}";
+		sep = ",\n";
+	}
+	os << "\n]}\n";
+}
+
+static uint64_t stats_now() {
+	return ParStats::now_ns();
+}
+
+// count [start_ns, now) as a call of slice (-1 for conveyor elements) of ti
+static void stats_busy(ParStats &st, const std::type_info &ti, int slice, uint64_t start_ns) {
+	uint64_t end_ns = ParStats::now_ns();
+	st.add_busy(start_ns, end_ns);
+	trace_event(st.tid, ti, slice, start_ns, end_ns);
+}
+
+static void stats_wait_parent(ParStats &st, uint64_t start_ns, uint64_t end_ns) {
+	st.wait_parent_ns += end_ns-start_ns;
+}
+
+static void stats_wait_child(ParStats &st, uint64_t start_ns, uint64_t end_ns) {
+	st.wait_child_ns += end_ns-start_ns;
+}
+#else
+static uint64_t stats_now() {
+	return 0;
+}
+
+static void stats_busy(ParStats &, const std::type_info &, int, uint64_t) {
+}
+
+static void stats_wait_parent(ParStats &, uint64_t, uint64_t) {
+}
+
+static void stats_wait_child(ParStats &, uint64_t, uint64_t) {
+}
+#endif // YALG_PAR_STATS
 
 /**
  * Simple parallel execution.
@@ -35,7 +249,12 @@ void ParallelExec::run_thread(ParallelExec *th, int n) {
 void ParallelExec::run(int n) {
 	int local_tick = 0;
 	int local_active_cnt;
+#ifdef YALG_HAVE_AFFINITY
+	if (cpus[n] >= 0 && !pin_self(cpus[n]))
+		cpus[n] = nodes[n] = -1;
+#endif
 	while (true) {
+		uint64_t idle_ns = stats_now();
 		// wait for new data from producer
 		{
 			std::unique_lock<std::mutex> lck(mtx_begin);
@@ -46,7 +265,10 @@ void ParallelExec::run(int n) {
 		}
 		if (local_active_cnt > 0) {
 			// process this batch and notify producer
+			uint64_t start_ns = stats_now();
+			stats_wait_parent(stats[n], idle_ns, start_ns);
 			exec_slice(n);
+			stats_busy(stats[n], typeid(*this), n, start_ns);
 			{
 				std::lock_guard<std::mutex> lck(mtx_end);
 				active_cnt--;
@@ -59,7 +281,58 @@ void ParallelExec::run(int n) {
 	}
 }
 
-ParallelExec::ParallelExec(int nthreads):nthreads(nthreads),tick(0),threads(nthreads),active_cnt(0) {
+/**
+ * Assign cpus and nodes to the slices according to the policy
+ */
+void ParallelExec::place(const ParAffinity &affinity) {
+	cpus.assign(nthreads, -1);
+	nodes.assign(nthreads, -1);
+#ifdef YALG_HAVE_AFFINITY
+	if (affinity.policy == ParAffinity::NONE)
+		return;
+	std::vector<int> avail = (affinity.policy == ParAffinity::LIST) ? affinity.cpus : allowed_cpus();
+	if (avail.empty())
+		return;
+	std::vector<int> node = cpu_nodes();
+	auto node_of = [&node](int cpu) {
+		return (cpu >= 0 && cpu < (int)node.size()) ? node[cpu] : 0;
+	};
+	if (affinity.policy == ParAffinity::COMPACT) {
+		std::stable_sort(avail.begin(), avail.end(), [&node_of](int a, int b) {
+			return node_of(a) < node_of(b);
+		});
+	} else if (affinity.policy == ParAffinity::SCATTER) {
+		// take the i-th cpu of every node before the (i+1)-th of any
+		std::vector<int> rank(avail.size());
+		std::vector<int> seen(CPU_SETSIZE, 0);
+		for (size_t i=0; i<avail.size(); i++)
+			rank[i] = seen[node_of(avail[i])]++;
+		std::vector<size_t> idx(avail.size());
+		for (size_t i=0; i<idx.size(); i++)
+			idx[i] = i;
+		std::stable_sort(idx.begin(), idx.end(), [&](size_t a, size_t b) {
+			return rank[a] < rank[b] || (rank[a] == rank[b] && node_of(avail[a]) < node_of(avail[b]));
+		});
+		std::vector<int> scattered;
+		for (size_t i:idx)
+			scattered.push_back(avail[i]);
+		avail.swap(scattered);
+	}
+	for (int n=0; n<nthreads; n++) {
+		cpus[n] = avail[n%avail.size()];
+		nodes[n] = node_of(cpus[n]);
+	}
+#else
+	(void)affinity;
+#endif
+}
+
+ParallelExec::ParallelExec(int nthreads):ParallelExec(nthreads, ParAffinity()) {
+}
+
+ParallelExec::ParallelExec(int nthreads, const ParAffinity &affinity):nthreads(nthreads),tick(0),threads(nthreads),active_cnt(0) {
+	stats.resize(nthreads);
+	place(affinity);
 	for (int i=0; i<nthreads; i++)
 		threads[i] = std::thread(run_thread, this, i);
 }
@@ -75,6 +348,26 @@ void ParallelExec::exec() {
 	threads_wait();
 }
 
+int ParallelExec::slice_cpu(int n) const {
+	return cpus[n];
+}
+
+int ParallelExec::slice_node(int n) const {
+	return nodes[n];
+}
+
+#ifdef YALG_PAR_STATS
+const ParStats &ParallelExec::slice_stats(int n) const {
+	return stats[n];
+}
+#endif
+
+void ParallelExec::slice_block(int n, size_t sz, size_t &lo, size_t &hi) const {
+	size_t blocksz = (sz+nthreads-1)/nthreads;
+	lo = std::min(blocksz*n, sz);
+	hi = std::min(lo+blocksz, sz);
+}
+
 /**
  * Parallel conveyor primitives
  * PipeHeadExec > PipeStageExec > PipeOutput -+
@@ -98,7 +391,27 @@ void ParallelExec::exec() {
  *
  * Each conveyor element may use 'batch' variable to determine which copy
  * of the result to work on this iteration
+ *
+ * Batch mode: with chunk > 1 each handshake carries up to chunk results,
+ * 'batch' counts individual results and each element has to store at least
+ * 2*chunk instances of results
+ *
+ * Termination: exception in next(), cancellation token or premature destruction
+ * set the conveyor-wide halt flag, so all elements drop the rest of their chunks.
+ * The exception travels down the conveyor within the same handshake and is
+ * rethrown by PipeOutputIterator
  */
+PipeCancelToken::PipeCancelToken():flag(std::make_shared<std::atomic<bool>>(false)) {
+}
+
+void PipeCancelToken::cancel() {
+	flag->store(true);
+}
+
+bool PipeCancelToken::cancelled() const {
+	return flag->load(std::memory_order_relaxed);
+}
+
 void PipeHeadExec::thread_wait_go() {
 	std::unique_lock<std::mutex> lck(mtx);
 	while (!go)
@@ -130,25 +443,72 @@ void PipeHeadExec::thread_notify_done() {
 	cv.notify_one();
 }
 
+bool PipeHeadExec::cancelled() const {
+	return halt->load(std::memory_order_relaxed) || cancel_token.cancelled();
+}
+
+/**
+ * Stop the whole conveyor, remember the exception if any
+ */
+void PipeHeadExec::stop(std::exception_ptr e) {
+	if (e && !error)
+		error = e;
+	halt->store(true);
+	done = true;
+}
+
+void *PipeHeadExec::invoke_next() {
+	uint64_t start_ns = stats_now();
+	void *res = next();
+	if (res != nullptr)
+		stats_busy(stats, typeid(*this), -1, start_ns);
+	return res;
+}
+
+#ifdef YALG_PAR_STATS
+const ParStats &PipeHeadExec::pipe_stats() const {
+	return stats;
+}
+#endif
+
 void PipeHeadExec::run() {
 	while (!done && !abort) {
+		uint64_t wait_ns = stats_now();
 		thread_wait_go();
+		stats_wait_child(stats, wait_ns, stats_now());
 		if (abort)
 			break;
-		last_arg = next();
-		done = (last_arg == nullptr);
-		batch++;
+		last_args.clear();
+		try {
+			while ((int)last_args.size() < chunk && !cancelled()) {
+				void *arg = invoke_next();
+				if (arg == nullptr) {
+					done = true;
+					break;
+				}
+				last_args.push_back(arg);
+				batch++;
+			}
+			if (cancelled())
+				stop(nullptr);
+		} catch (...) {
+			stop(std::current_exception());
+		}
 		thread_notify_done();
 	}
 }
 
-PipeHeadExec::PipeHeadExec() {
+PipeHeadExec::PipeHeadExec(int chunk, const PipeCancelToken &token):chunk(chunk),cancel_token(token) {
 	batch = 0;
 	go = false;
 	done = false;
 	abort = false;
-	depth = 0;
-	last_arg = nullptr;
+	halt = std::make_shared<std::atomic<bool>>(false);
+	last_args.reserve(chunk);
+}
+
+PipeCancelToken PipeHeadExec::token() const {
+	return cancel_token;
 }
 
 void PipeStageExec::run_thread(PipeHeadExec *th) {
@@ -156,23 +516,43 @@ void PipeStageExec::run_thread(PipeHeadExec *th) {
 }
 
 void PipeStageExec::run() {
-	void *parent_last_arg = nullptr;
+	// parent's chunk obtained on previous handshake
+	std::vector<void*> parent_args;
+	parent_args.reserve(chunk);
 	while (!done && !abort) {
+		uint64_t wait_ns = stats_now();
 		thread_wait_go();
+		stats_wait_child(stats, wait_ns, stats_now());
 		if (abort)
 			break;
-		if (!parent.done) {
+		last_args.clear();
+		// parent's last chunk was handed over on previous handshake
+		bool parent_done = parent.done;
+		if (!parent_done)
 			parent.thread_notify_go();
-			// idle until conveyor is filled
-			if (batch >= depth)
-				last_arg = next(parent_last_arg);
+		// empty while conveyor is being filled
+		try {
+			for (void *arg:parent_args) {
+				if (cancelled())
+					break;
+				last_args.push_back(invoke_next(arg));
+				batch++;
+			}
+		} catch (...) {
+			stop(std::current_exception());
+		}
+		if (!parent_done) {
+			wait_ns = stats_now();
 			parent.thread_wait_done();
-			parent_last_arg = parent.last_arg;
+			stats_wait_parent(stats, wait_ns, stats_now());
+			std::swap(parent_args, parent.last_args);
+			if (parent.error)
+				stop(parent.error);
 		} else {
-			last_arg = nullptr;
 			done = true;
 		}
-		batch++;
+		if (cancelled())
+			stop(nullptr);
 		thread_notify_done();
 	}
 }
@@ -181,50 +561,82 @@ void *PipeStageExec::next() {
 	return nullptr;
 }
 
-PipeStageExec::PipeStageExec(PipeHeadExec &parent):PipeHeadExec(),parent(parent) {
-	depth = parent.depth+1;
+void *PipeStageExec::invoke_next(void *arg) {
+	uint64_t start_ns = stats_now();
+	void *res = next(arg);
+	stats_busy(stats, typeid(*this), -1, start_ns);
+	return res;
+}
+
+PipeStageExec::PipeStageExec(PipeHeadExec &parent):PipeHeadExec(parent.chunk, parent.cancel_token),parent(parent) {
+	halt = parent.halt;
 	thread = std::thread(run_thread, &parent);
 }
 
 PipeStageExec::~PipeStageExec() {
+	// stops the conveyor if it is not exhausted yet
+	halt->store(true);
 	parent.thread_notify_abort();
 	thread.join();
 }
 
-PipeOutputIterator::PipeOutputIterator(PipeStageExec &tail):tail(tail),value(nullptr) {
+PipeOutputIterator::PipeOutputIterator(PipeStageExec &tail):tail(tail),value(nullptr),pos(0),last(true),at_end(true) {
 }
 
 bool PipeOutputIterator::operator==(const PipeOutputIterator &b) const {
-	return value == b.value;
+	return at_end == b.at_end;
 }
 
 bool PipeOutputIterator::operator!=(const PipeOutputIterator &b) const {
-	return value != b.value;
+	return at_end != b.at_end;
 }
 
-PipeOutputIterator &PipeOutputIterator::seek_begin() {
-	while (!tail.parent.done && tail.parent.batch<=tail.parent.depth) {
-		tail.parent.thread_notify_go();
+/**
+ * Take over the next non-empty chunk from the conveyor and let
+ * the conveyor work on the following one while we iterate
+ */
+void PipeOutputIterator::fetch() {
+	chunk.clear();
+	pos = 0;
+	while (chunk.empty() && !last) {
 		tail.parent.thread_wait_done();
+		if (tail.parent.error) {
+			last = at_end = true;
+			value = nullptr;
+			std::rethrow_exception(tail.parent.error);
+		}
+		std::swap(chunk, tail.parent.last_args);
+		last = tail.parent.done;
+		if (tail.parent.cancelled()) {
+			chunk.clear();
+			last = true;
+		}
+		if (!last)
+			tail.parent.thread_notify_go();
 	}
-	value = tail.parent.last_arg;
-	tail.parent.thread_notify_go();
+	at_end = chunk.empty();
+	value = at_end ? nullptr : chunk[0];
+}
+
+PipeOutputIterator &PipeOutputIterator::seek_begin() {
+	last = tail.parent.done;
+	if (!last)
+		tail.parent.thread_notify_go();
+	fetch();
 	return *this;
 }
 
 PipeOutputIterator &PipeOutputIterator::seek_end() {
 	value = nullptr;
+	at_end = true;
 	return *this;
 }
 
 void PipeOutputIterator::operator++() {
-	tail.parent.thread_wait_done();
-	value = tail.parent.last_arg;
-	if (!tail.parent.done) {
-		tail.parent.thread_notify_go();
-	} else {
-		value = nullptr;
-	}
+	if (++pos < chunk.size() && !tail.parent.cancelled())
+		value = chunk[pos];
+	else
+		fetch();
 }
 
 void *PipeOutputIterator::operator*() const {
@@ -0,0 +1,40 @@
+#include <par_prefix.hpp>
+#include <algorithm>
+
+ParKmp::ParKmp(int nthreads):ParallelExec(nthreads),found(nthreads),base(nthreads+1) {
+}
+
+void ParKmp::exec_slice(int n) {
+	size_t lo, hi;
+	slice_block(n, sz, lo, hi);
+	if (!copy) {
+		std::vector<size_t> &out = found[n];
+		out.clear();
+		const size_t ksz = pattern->size();
+		const size_t scan_hi = std::min(sz, hi+std::max<size_t>(ksz, 1)-1);
+		pattern->each(text+lo, text+scan_hi, [&](size_t p) {
+			// the next slice owns the matches starting in the overlap,
+			// the last one also owns the empty key match at the end
+			if (lo+p < hi || (n == nthreads-1 && lo+p == sz))
+				out.push_back(lo+p);
+			return true;
+		});
+	} else {
+		std::copy(found[n].begin(), found[n].end(), res->begin()+base[n]);
+	}
+}
+
+void ParKmp::find_all(const KmpPattern &pattern, const char *begin, const char *end, std::vector<size_t> &res) {
+	this->pattern = &pattern;
+	text = begin;
+	sz = end-begin;
+	this->res = &res;
+	copy = false;
+	exec();
+	base[0] = 0;
+	for (int n=0; n<nthreads; n++)
+		base[n+1] = base[n]+found[n].size();
+	res.resize(base[nthreads]);
+	copy = true;
+	exec();
+}
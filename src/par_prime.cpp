@@ -0,0 +1,111 @@
+#include "par_prime.hpp"
+#include <algorithm>
+
+/**
+ * Parallel segmented sieve. The range is cut into windows of window_bytes*30
+ * numbers, every round each slice sieves the next window with its own
+ * PrimeSegmentSieve, and then the windows are handed out in slice order
+ */
+ParPrimeSieve::ParPrimeSieve(int nthreads):ParallelExec(nthreads),found(nthreads),counts(nthreads) {
+}
+
+void ParPrimeSieve::prepare(uint64_t lo, uint64_t hi) {
+	this->lo = lo;
+	this->hi = std::max(lo, hi);
+	pos = lo;
+	if (sprimes.empty() || uint64_t(sprimes.back())*sprimes.back() < this->hi)
+		sprimes = PrimeSegmentSieve::sieving_primes(this->hi);
+}
+
+void ParPrimeSieve::slice_range(int n, uint64_t &a, uint64_t &b) const {
+	// windows start at multiples of 30, so they never share a byte
+	uint64_t start = pos/30*30;
+	uint64_t w = counting ? ((hi-start)/nthreads/30+1)*30 : window_bytes*30;
+	a = std::min(std::max(start+n*w, pos), hi);
+	b = std::min(start+(n+1)*w, hi);
+	if (b < a)
+		b = a;
+}
+
+void ParPrimeSieve::exec_slice(int n) {
+	uint64_t a, b;
+	slice_range(n, a, b);
+	found[n].clear();
+	counts[n] = 0;
+	if (a >= b)
+		return;
+	PrimeSegmentSieve sieve(a, b, sprimes);
+	if (counting) {
+		counts[n] = sieve.count();
+	} else {
+		while (sieve.next())
+			found[n].insert(found[n].end(), sieve.primes().begin(), sieve.primes().end());
+	}
+}
+
+bool ParPrimeSieve::next_round() {
+	if (pos >= hi)
+		return false;
+	counting = false;
+	exec();
+	uint64_t a, b;
+	slice_range(nthreads-1, a, b);
+	pos = b;
+	return true;
+}
+
+uint64_t ParPrimeSieve::count(uint64_t lo, uint64_t hi) {
+	prepare(lo, hi);
+	if (pos >= this->hi)
+		return 0;
+	counting = true;
+	exec();
+	uint64_t cnt = 0;
+	for (auto c:counts)
+		cnt += c;
+	return cnt;
+}
+
+/**
+ * Every slice factors its block into its own buffer first, then the buffers
+ * are copied to their places in the flat output
+ */
+ParFactor::ParFactor(const SpfTable &table, int nthreads):ParallelExec(nthreads),table(table),part(nthreads),base(nthreads+1) {
+}
+
+void ParFactor::exec_slice(int n) {
+	size_t lo, hi;
+	slice_block(n, sz, lo, hi);
+	std::vector<size_t> &off = *offsets;
+	if (!copy) {
+		std::vector<uint32_t> &buf = part[n];
+		uint32_t p[32];
+		buf.clear();
+		for (size_t i=lo; i<hi; i++) {
+			off[i] = buf.size(); // relative to the slice for now
+			int np = table.factors_all(in[i], p);
+			buf.insert(buf.end(), p, p+np);
+		}
+	} else {
+		for (size_t i=lo; i<hi; i++)
+			off[i] += base[n];
+		std::copy(part[n].begin(), part[n].end(), factors->begin()+base[n]);
+	}
+}
+
+void ParFactor::factor(const uint32_t *in, size_t sz, std::vector<uint32_t> &factors, std::vector<size_t> &offsets) {
+	this->in = in;
+	this->sz = sz;
+	this->factors = &factors;
+	this->offsets = &offsets;
+	offsets.resize(sz+1);
+	copy = false;
+	exec();
+	base[0] = 0;
+	for (int n=0; n<nthreads; n++)
+		base[n+1] = base[n]+part[n].size();
+	factors.resize(base[nthreads]);
+	offsets[sz] = base[nthreads];
+	copy = true;
+	exec();
+}
@@ -1,12 +1,33 @@
 #include <prefix.hpp>
+#include <system_error>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <algorithm>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// AVX2 kernel is compiled with target attribute and picked at runtime
+#define YALG_X86_DISPATCH
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /**
  * KMP prefix function
  * prefix vector should be given in the same size as str (or greater)
  */
 void prefix_function(const std::string &str, std::vector<int> &prefix) {
-	size_t sz = str.size();
+	prefix_function(str.data(), str.data()+str.size(), prefix);
+}
+
+void prefix_function(const char *str, const char *end, std::vector<int> &prefix) {
+	size_t sz = end-str;
 	size_t k = 0;
+	if (sz == 0)
+		return;
 	prefix[0] = 0;
 	for (size_t i=1; i<sz; i++) {
 		for (; k>0 && str[i] != str[k]; k=prefix[k-1]);
@@ -19,19 +40,491 @@ void prefix_function(const std::string &str, std::vector<int> &prefix) {
 	}
 }
 
+void z_function(const char *str, const char *end, std::vector<int> &z) {
+	const int sz = end-str;
+	z.assign(sz, 0);
+	if (sz == 0)
+		return;
+	z[0] = sz;
+	// [l, r) is the rightmost segment matching a prefix
+	for (int i=1, l=0, r=0; i<sz; i++) {
+		int k = i < r ? std::min(r-i, z[i-l]) : 0;
+		while (i+k < sz && str[k] == str[i+k])
+			k++;
+		z[i] = k;
+		if (i+k > r) {
+			l = i;
+			r = i+k;
+		}
+	}
+}
+
+/**
+ * SA-IS: suffixes are S-type if they are smaller than the next one and
+ * L-type otherwise. Leftmost S-type (LMS) suffixes are sorted first by
+ * induced sorting of their substrings, then by the suffix array of
+ * the reduced string of LMS substring names when the names are not unique.
+ * Sorted LMS suffixes induce the order of all the others
+ * @param s - symbols in [0, upper]
+ */
+template<class T> static std::vector<int> sa_is(const T *s, int n, int upper) {
+	if (n == 0)
+		return {};
+	if (n == 1)
+		return {0};
+	if (n == 2)
+		return s[0] < s[1] ? std::vector<int>{0, 1} : std::vector<int>{1, 0};
+	std::vector<int> sa(n);
+	std::vector<bool> ls(n);
+	for (int i=n-2; i>=0; i--)
+		ls[i] = s[i] == s[i+1] ? ls[i+1] : s[i] < s[i+1];
+	// bucket starts for S-type (sum_s) and L-type (sum_l) suffixes
+	std::vector<int> sum_l(upper+1), sum_s(upper+1);
+	for (int i=0; i<n; i++)
+		if (!ls[i])
+			sum_s[s[i]]++;
+		else
+			sum_l[s[i]+1]++;
+	for (int i=0; i<=upper; i++) {
+		sum_s[i] += sum_l[i];
+		if (i < upper)
+			sum_l[i+1] += sum_s[i];
+	}
+	std::vector<int> buf(upper+1);
+	auto induce = [&](const std::vector<int> &lms) {
+		std::fill(sa.begin(), sa.end(), -1);
+		std::copy(sum_s.begin(), sum_s.end(), buf.begin());
+		for (int d:lms)
+			if (d != n)
+				sa[buf[s[d]]++] = d;
+		std::copy(sum_l.begin(), sum_l.end(), buf.begin());
+		sa[buf[s[n-1]]++] = n-1;
+		for (int i=0; i<n; i++) {
+			int v = sa[i];
+			if (v >= 1 && !ls[v-1])
+				sa[buf[s[v-1]]++] = v-1;
+		}
+		std::copy(sum_l.begin(), sum_l.end(), buf.begin());
+		for (int i=n-1; i>=0; i--) {
+			int v = sa[i];
+			if (v >= 1 && ls[v-1])
+				sa[--buf[s[v-1]+1]] = v-1;
+		}
+	};
+	std::vector<int> lms_map(n+1, -1), lms;
+	int m = 0;
+	for (int i=1; i<n; i++)
+		if (!ls[i-1] && ls[i])
+			lms_map[i] = m++;
+	lms.reserve(m);
+	for (int i=1; i<n; i++)
+		if (!ls[i-1] && ls[i])
+			lms.push_back(i);
+	induce(lms);
+	if (m) {
+		std::vector<int> sorted_lms;
+		sorted_lms.reserve(m);
+		for (int v:sa)
+			if (lms_map[v] != -1)
+				sorted_lms.push_back(v);
+		// name LMS substrings, equal ones share the name
+		std::vector<int> rec_s(m);
+		int rec_upper = 0;
+		rec_s[lms_map[sorted_lms[0]]] = 0;
+		for (int i=1; i<m; i++) {
+			int l = sorted_lms[i-1], r = sorted_lms[i];
+			int end_l = lms_map[l]+1 < m ? lms[lms_map[l]+1] : n;
+			int end_r = lms_map[r]+1 < m ? lms[lms_map[r]+1] : n;
+			bool same = true;
+			if (end_l-l != end_r-r) {
+				same = false;
+			} else {
+				while (l < end_l && s[l] == s[r]) {
+					l++;
+					r++;
+				}
+				if (l == n || s[l] != s[r])
+					same = false;
+			}
+			if (!same)
+				rec_upper++;
+			rec_s[lms_map[sorted_lms[i]]] = rec_upper;
+		}
+		lms_map = std::vector<int>();
+		std::vector<int> rec_sa = sa_is(rec_s.data(), m, rec_upper);
+		for (int i=0; i<m; i++)
+			sorted_lms[i] = lms[rec_sa[i]];
+		induce(sorted_lms);
+	}
+	return sa;
+}
+
+std::vector<int> suffix_array(const char *begin, const char *end) {
+	return sa_is(reinterpret_cast<const uint8_t*>(begin), end-begin, 255);
+}
+
+std::vector<int> lcp_array(const char *str, const char *end, const std::vector<int> &sa) {
+	const int sz = end-str;
+	std::vector<int> rank(sz), lcp(sz);
+	for (int i=0; i<sz; i++)
+		rank[sa[i]] = i;
+	// lcp of the next suffix drops by one at most
+	for (int i=0, h=0; i<sz; i++) {
+		if (rank[i] == 0) {
+			h = 0;
+			continue;
+		}
+		int j = sa[rank[i]-1];
+		while (i+h < sz && j+h < sz && str[i+h] == str[j+h])
+			h++;
+		lcp[rank[i]] = h;
+		if (h > 0)
+			h--;
+	}
+	return lcp;
+}
+
+SuffixIndex::SuffixIndex(const char *begin, const char *end):sa(suffix_array(begin, end)),rank(sa.size()),rmq(lcp_array(begin, end, sa)) {
+	for (size_t i=0; i<sa.size(); i++)
+		rank[sa[i]] = i;
+}
+
+KmpPattern::KmpPattern(const char *begin, const char *end):key(begin, end),prefix(key.size()) {
+	prefix_function(key, prefix);
+}
+
+KmpPattern::KmpPattern(const std::string &key):key(key),prefix(key.size()) {
+	prefix_function(key, prefix);
+}
+
+size_t KmpPattern::find(const char *begin, const char *end) const {
+	size_t pos = std::string::npos;
+	each(begin, end, [&pos](size_t p) {
+		pos = p;
+		return false;
+	});
+	return pos;
+}
+
+/**
+ * The mapping stays valid after the descriptor is closed. Empty files are
+ * not mapped at all, mmap() rejects zero length
+ */
+MappedFile::MappedFile(const std::string &path):ptr(nullptr),sz(0) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), path);
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		throw std::system_error(err, std::generic_category(), path);
+	}
+	sz = st.st_size;
+	if (sz > 0) {
+		void *p = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			throw std::system_error(err, std::generic_category(), path);
+		}
+		madvise(p, sz, MADV_SEQUENTIAL);
+		ptr = static_cast<const char*>(p);
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (ptr)
+		munmap(const_cast<char*>(ptr), sz);
+}
+
+/**
+ * The trie is built with sibling lists, the failure links are computed in
+ * BFS order like the prefix function, then the trie is laid out in the
+ * requested table. Double array bases are placed first-fit in BFS order
+ */
+AhoCorasick::AhoCorasick(const std::vector<std::string> &keys, Layout layout) {
+	std::fill(cls, cls+256, 0);
+	classes = 1;
+	for (auto &k:keys)
+		for (char ch:k)
+			if (cls[uint8_t(ch)] == 0)
+				cls[uint8_t(ch)] = classes++;
+	// trie, node 0 is the root
+	std::vector<int32_t> first{-1}, sibling{-1}, node_fail{0};
+	std::vector<uint16_t> label{0};
+	std::vector<std::vector<int32_t>> ends(1);
+	auto child = [&](int32_t u, int c) {
+		int32_t v = first[u];
+		while (v >= 0 && label[v] != c)
+			v = sibling[v];
+		return v;
+	};
+	for (size_t i=0; i<keys.size(); i++) {
+		lens.push_back(keys[i].size());
+		if (keys[i].empty())
+			continue;
+		int32_t u = 0;
+		for (char ch:keys[i]) {
+			int c = cls[uint8_t(ch)];
+			int32_t v = child(u, c);
+			if (v < 0) {
+				v = first.size();
+				first.push_back(-1);
+				sibling.push_back(first[u]);
+				first[u] = v;
+				label.push_back(c);
+				node_fail.push_back(0);
+				ends.emplace_back();
+			}
+			u = v;
+		}
+		ends[u].push_back(i);
+	}
+	const int32_t nodes = first.size();
+	std::vector<int32_t> order{0};
+	for (size_t i=0; i<order.size(); i++) {
+		int32_t u = order[i];
+		for (int32_t v=first[u]; v>=0; v=sibling[v]) {
+			if (u != 0) {
+				int32_t f = node_fail[u], t;
+				while ((t = child(f, label[v])) < 0 && f != 0)
+					f = node_fail[f];
+				node_fail[v] = t >= 0 ? t : 0;
+			}
+			order.push_back(v);
+		}
+	}
+	// output chains, entries in BFS order so the next one is always known
+	std::vector<int32_t> node_report(nodes, -1);
+	out_begin.push_back(0);
+	for (int32_t u:order) {
+		int32_t next = u ? node_report[node_fail[u]] : -1;
+		if (ends[u].empty()) {
+			node_report[u] = next;
+			continue;
+		}
+		node_report[u] = out_next.size();
+		out_next.push_back(next);
+		out_ids.insert(out_ids.end(), ends[u].begin(), ends[u].end());
+		out_begin.push_back(out_ids.size());
+	}
+	kind = layout;
+	if (kind == AUTO)
+		kind = size_t(nodes)*classes*sizeof(int32_t) <= dense_bytes ? DENSE : DOUBLE_ARRAY;
+	if (kind == DENSE) {
+		dense.assign(size_t(nodes)*classes, 0);
+		for (int32_t u:order) {
+			int32_t *row = &dense[size_t(u)*classes];
+			if (u != 0)
+				std::copy_n(&dense[size_t(node_fail[u])*classes], classes, row);
+			for (int32_t v=first[u]; v>=0; v=sibling[v])
+				row[label[v]] = v;
+		}
+		report.swap(node_report);
+		return;
+	}
+	// slot of every trie node
+	std::vector<int32_t> pos(nodes, -1);
+	pos[0] = 0;
+	check.assign(1, -1);
+	base.assign(1, 0);
+	// free slots in ascending order, the ones past check.size() are free too
+	std::vector<int32_t> next_free{-1}, prev_free{-1};
+	int32_t head = -1, tail = -1;
+	auto grow = [&](int32_t sz) {
+		for (int32_t i=check.size(); i<sz; i++) {
+			check.push_back(-1);
+			base.push_back(0);
+			next_free.push_back(-1);
+			prev_free.push_back(tail);
+			(tail < 0 ? head : next_free[tail]) = i;
+			tail = i;
+		}
+	};
+	auto occupy = [&](int32_t i) {
+		(prev_free[i] < 0 ? head : next_free[prev_free[i]]) = next_free[i];
+		(next_free[i] < 0 ? tail : prev_free[next_free[i]]) = prev_free[i];
+	};
+	std::vector<int> labels;
+	for (int32_t u:order) {
+		labels.clear();
+		for (int32_t v=first[u]; v>=0; v=sibling[v])
+			labels.push_back(label[v]);
+		if (labels.empty())
+			continue;
+		std::sort(labels.begin(), labels.end());
+		// the first label takes a free slot, check the others
+		int32_t b;
+		for (int32_t f=head; ; f=next_free[f]) {
+			b = f < 0 ? std::max<int32_t>(1, check.size()-labels[0]) : f-labels[0];
+			if (b < 1)
+				continue;
+			bool fits = true;
+			for (int c:labels)
+				if (b+c < int32_t(check.size()) && check[b+c] >= 0) {
+					fits = false;
+					break;
+				}
+			if (fits || f < 0)
+				break;
+		}
+		grow(b+labels.back()+1);
+		base[pos[u]] = b;
+		for (int32_t v=first[u]; v>=0; v=sibling[v]) {
+			pos[v] = b+label[v];
+			check[pos[v]] = pos[u];
+			occupy(pos[v]);
+		}
+	}
+	fail.assign(check.size(), 0);
+	report.assign(check.size(), -1);
+	for (int32_t u=0; u<nodes; u++) {
+		fail[pos[u]] = pos[node_fail[u]];
+		report[pos[u]] = node_report[u];
+	}
+}
+
+size_t AhoCorasick::bytes() const {
+	return sizeof(int32_t)*(dense.size()+base.size()+check.size()+fail.size()+report.size()
+		+out_begin.size()+out_ids.size()+out_next.size()+lens.size());
+}
+
 /**
  * find first substring is a string based on KMP prefix algorithm
- * will use extra memory to construct intermediate string and prefix buffer
+ * the prefix function is built for key only, str is not copied
  */
 size_t kmp_strstr(const std::string &str, const std::string &key) {
-	size_t ksz  = key.size();
-	std::string kmp = key + char(0) + str;
-	size_t sz = kmp.size();
-	std::vector<int> prefix(kmp.size());
-	prefix_function(kmp, prefix);
-	size_t pos;
-	for (pos=ksz+1; pos<sz; pos++)
-		if (prefix[pos] == ksz)
-			break;
-	return pos-ksz-ksz;
+	return kmp_strstr(str.data(), str.size(), key.data(), key.size());
+}
+
+size_t kmp_strstr(const char *str, size_t sz, const char *key, size_t ksz) {
+	return KmpPattern(key, key+ksz).find(str, str+sz);
+}
+
+// verification work allowed before position i, KMP takes over beyond it
+static inline size_t verify_budget(size_t i, size_t ksz) {
+	return 2*i+16*ksz;
+}
+
+// key[1..ksz-2] at p, both ends are already compared by the filter
+static inline bool verify(const char *p, const char *key, size_t ksz, size_t &work) {
+	work += ksz;
+	return memcmp(p+1, key+1, ksz-2) == 0;
+}
+
+/**
+ * Filter kernels scan the candidate positions [i, sz-ksz] in full vectors
+ * while the verification work fits the budget, advance i past the scanned
+ * ones and return the first match or npos. The rest is done by the caller
+ */
+typedef size_t (*strstr_kernel_t)(const char *str, size_t sz, const char *key, size_t ksz, size_t &i, size_t &work);
+
+static size_t filter_scalar(const char*, size_t, const char*, size_t, size_t&, size_t&) {
+	return std::string::npos;
+}
+
+#if defined(YALG_X86_DISPATCH) || defined(__SSE2__)
+#if defined(YALG_X86_DISPATCH) && !defined(__SSE2__)
+__attribute__((target("sse2")))
+#endif
+static size_t filter_sse2(const char *str, size_t sz, const char *key, size_t ksz, size_t &i, size_t &work) {
+	const __m128i first = _mm_set1_epi8(key[0]);
+	const __m128i last = _mm_set1_epi8(key[ksz-1]);
+	const size_t n = sz-ksz+1;
+	for (; i+16<=n && work<=verify_budget(i, ksz); i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(str+i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(str+i+ksz-1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask&=mask-1) {
+			size_t pos = i+__builtin_ctz(mask);
+			if (verify(str+pos, key, ksz, work))
+				return pos;
+		}
+	}
+	return std::string::npos;
+}
+#endif
+
+#if defined(YALG_X86_DISPATCH)
+__attribute__((target("avx2")))
+static size_t filter_avx2(const char *str, size_t sz, const char *key, size_t ksz, size_t &i, size_t &work) {
+	const __m256i first = _mm256_set1_epi8(key[0]);
+	const __m256i last = _mm256_set1_epi8(key[ksz-1]);
+	const size_t n = sz-ksz+1;
+	for (; i+32<=n && work<=verify_budget(i, ksz); i+=32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(str+i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(str+i+ksz-1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask&=mask-1) {
+			size_t pos = i+__builtin_ctz(mask);
+			if (verify(str+pos, key, ksz, work))
+				return pos;
+		}
+	}
+	return std::string::npos;
+}
+#endif
+
+struct StrstrKernel {
+	strstr_kernel_t fn;
+	const char *name;
+	StrstrKernel() {
+		fn = filter_scalar;
+		name = "scalar";
+#if defined(YALG_X86_DISPATCH)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			fn = filter_avx2;
+			name = "avx2";
+		} else if (__builtin_cpu_supports("sse2")) {
+			fn = filter_sse2;
+			name = "sse2";
+		}
+#elif defined(__SSE2__)
+		fn = filter_sse2;
+		name = "sse2";
+#endif
+	}
+};
+
+static const StrstrKernel &strstr_kernel() {
+	static StrstrKernel kernel;
+	return kernel;
+}
+
+const char *simd_strstr_kernel() {
+	return strstr_kernel().name;
+}
+
+/**
+ * The vector kernel runs first, then the positions left are checked one
+ * by one under the same budget, and KMP finishes the search if it is spent
+ */
+size_t simd_strstr(const char *str, size_t sz, const char *key, size_t ksz) {
+	if (ksz == 0)
+		return 0;
+	if (ksz > sz)
+		return std::string::npos;
+	if (ksz == 1) {
+		const void *p = memchr(str, key[0], sz);
+		return p ? static_cast<const char*>(p)-str : std::string::npos;
+	}
+	size_t i = 0, work = 0;
+	size_t pos = strstr_kernel().fn(str, sz, key, ksz, i, work);
+	if (pos != std::string::npos)
+		return pos;
+	const size_t n = sz-ksz+1;
+	for (; i<n && work<=verify_budget(i, ksz); i++)
+		if (str[i] == key[0] && str[i+ksz-1] == key[ksz-1] && verify(str+i, key, ksz, work))
+			return i;
+	if (i >= n)
+		return std::string::npos;
+	pos = KmpPattern(key, key+ksz).find(str+i, str+sz);
+	return pos == std::string::npos ? pos : pos+i;
+}
+
+size_t simd_strstr(const std::string &str, const std::string &key) {
+	return simd_strstr(str.data(), str.size(), key.data(), key.size());
 }
@@ -1,7 +1,211 @@
 #include "prime.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
+#ifdef __SIZEOF_INT128__
 /**
- * Naive prime number factorization in O(sqrt(N))
+ * Montgomery arithmetic modulo odd n < 2^64 with R = 2^64
+ * Numbers are kept as a*R mod n, so the product needs no division
+ */
+struct Montgomery {
+	uint64_t n;
+	uint64_t ninv;	// n^-1 mod R
+	uint64_t r2;	// R^2 mod n
+	Montgomery(uint64_t n):n(n) {
+		ninv = n;	// correct to 3 bits, each Newton step doubles them
+		for (int i=0; i<5; i++)
+			ninv *= 2-n*ninv;
+		uint64_t r1 = -n % n;
+		r2 = (__uint128_t)r1*r1 % n;
+	}
+	// t/R mod n
+	uint64_t reduce(__uint128_t t) const {
+		uint64_t m = uint64_t(t)*ninv;
+		uint64_t hi = t >> 64;
+		uint64_t mn = ((__uint128_t)m*n) >> 64;
+		return hi >= mn ? hi-mn : hi-mn+n;
+	}
+	uint64_t mul(uint64_t a, uint64_t b) const {
+		return reduce((__uint128_t)a*b);
+	}
+	uint64_t to(uint64_t a) const {
+		return mul(a%n, r2);
+	}
+	uint64_t from(uint64_t a) const {
+		return reduce(a);
+	}
+	uint64_t pow(uint64_t a, uint64_t e) const {
+		uint64_t r = to(1);
+		for (; e; e>>=1, a=mul(a, a))
+			if (e&1)
+				r = mul(r, a);
+		return r;
+	}
+};
+
+/**
+ * Deterministic Miller-Rabin, these 7 bases are sufficient for n < 2^64
+ */
+bool is_prime(uint64_t n) {
+	if (n < 2)
+		return false;
+	for (uint64_t p:{2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37})
+		if (n % p == 0)
+			return n == p;
+	if (n < 37*37)
+		return true;
+	const Montgomery mg(n);
+	uint64_t d = n-1;
+	int s = 0;
+	while (!(d&1)) {
+		d >>= 1;
+		s++;
+	}
+	const uint64_t one = mg.to(1), minus_one = mg.to(n-1);
+	for (uint64_t a:{2, 325, 9375, 28178, 450775, 9780504, 1795265022}) {
+		if (a % n == 0)
+			continue;
+		uint64_t x = mg.pow(mg.to(a), d);
+		if (x == one || x == minus_one)
+			continue;
+		int i = 1;
+		for (; i<s; i++) {
+			x = mg.mul(x, x);
+			if (x == minus_one)
+				break;
+		}
+		if (i == s)
+			return false;
+	}
+	return true;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+	while (b) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * Brent's variant of Pollard's rho, n must be odd and composite
+ * Iterates x -> x^2+c in Montgomery form and takes one gcd per m steps
+ * @return non-trivial divisor of n
+ */
+static uint64_t pollard_brent(uint64_t n) {
+	const Montgomery mg(n);
+	constexpr uint64_t m = 128;
+	for (uint64_t c=1; ; c++) {
+		const uint64_t cm = mg.to(c);
+		auto f = [&](uint64_t x) {
+			uint64_t y = mg.mul(x, x);
+			return y >= n-cm ? y-(n-cm) : y+cm;
+		};
+		uint64_t x, y = mg.to(2), ys = y, q = mg.to(1), g = 1;
+		for (uint64_t r=1; g==1; r<<=1) {
+			x = y;
+			for (uint64_t i=0; i<r; i++)
+				y = f(y);
+			for (uint64_t k=0; k<r && g==1; k+=m) {
+				ys = y;
+				for (uint64_t i=0; i<m && i<r-k; i++) {
+					y = f(y);
+					q = mg.mul(q, x > y ? x-y : y-x);
+				}
+				g = gcd(q, n);
+			}
+		}
+		if (g == n) {
+			// the product hit 0, redo the last block step by step
+			do {
+				ys = f(ys);
+				g = gcd(x > ys ? x-ys : ys-x, n);
+			} while (g == 1);
+		}
+		if (g != n)
+			return g;
+	}
+}
+
+/**
+ * all prime factors of n without small factors, unordered
+ */
+static int rho_factors(uint64_t n, uint64_t p[]) {
+	if (is_prime(n)) {
+		p[0] = n;
+		return 1;
+	}
+	uint64_t d = pollard_brent(n);
+	int np = rho_factors(d, p);
+	return np+rho_factors(n/d, p+np);
+}
+#else
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t n) {
+	uint64_t r = 0;
+	for (a%=n; b; b>>=1) {
+		if (b&1)
+			r = r >= n-a ? r-(n-a) : r+a;
+		a = a >= n-a ? a-(n-a) : a+a;
+	}
+	return r;
+}
+
+static uint64_t powmod(uint64_t a, uint64_t e, uint64_t n) {
+	uint64_t r = 1%n;
+	for (a%=n; e; e>>=1, a=mulmod(a, a, n))
+		if (e&1)
+			r = mulmod(r, a, n);
+	return r;
+}
+
+/**
+ * Deterministic Miller-Rabin, these 7 bases are sufficient for n < 2^64
+ */
+bool is_prime(uint64_t n) {
+	if (n < 2)
+		return false;
+	for (uint64_t p:{2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37})
+		if (n % p == 0)
+			return n == p;
+	if (n < 37*37)
+		return true;
+	uint64_t d = n-1;
+	int s = 0;
+	while (!(d&1)) {
+		d >>= 1;
+		s++;
+	}
+	for (uint64_t a:{2, 325, 9375, 28178, 450775, 9780504, 1795265022}) {
+		if (a % n == 0)
+			continue;
+		uint64_t x = powmod(a, d, n);
+		if (x == 1 || x == n-1)
+			continue;
+		int i = 1;
+		for (; i<s; i++) {
+			x = mulmod(x, x, n);
+			if (x == n-1)
+				break;
+		}
+		if (i == s)
+			return false;
+	}
+	return true;
+}
+#endif
+
+// trial division is used for all factors below this limit
+static const uint64_t trial_limit = 1<<12;
+// and for the numbers below this threshold
+static const uint64_t rho_threshold = 1ULL<<32;
+
+/**
+ * Prime number factorization
+ * Trial division for small factors and small n, then Pollard-rho
+ * with Miller-Rabin for the remaining part of n >= 2^32
  * @param n - number that you want to factorize
  * @param p[] - preallocated recipient array where the of ordered
  *   prime numbers of n will be placed
@@ -11,19 +215,31 @@
  */
 int prime_factors_all(uint64_t n, uint64_t p[]) {
 	int np = 0;
-	for (uint64_t i = 2; i <= n / i; i++) {
+	uint64_t i = 2;
+	for (; i <= n / i; i++) {
+#ifdef __SIZEOF_INT128__
+		if (i >= trial_limit && n >= rho_threshold)
+			break;
+#endif
 		while (n % i == 0) {
 			p[np++] = i;
 			n /= i;
 		}
 	}
+#ifdef __SIZEOF_INT128__
+	if (i <= n / i) {
+		int nr = rho_factors(n, p+np);
+		std::sort(p+np, p+np+nr);
+		return np+nr;
+	}
+#endif
 	if (n > 1)
 		p[np++] = n;
 	return np;
 }
 
 /**
- * Naive prime number factorization in O(sqrt(N))
+ * Prime number factorization, see prime_factors_all()
  * @param n - number that you want to factorize
  * @param p[] - preallocated pairs array where the of ordered
  *   prime factors with their respective powers will be placed
@@ -32,20 +248,15 @@ int prime_factors_all(uint64_t n, uint64_t p[]) {
  * @return number of populated primes in p[]
  */
 int prime_factors_uniq(uint64_t n, std::pair<uint64_t,int> p[]) {
+	uint64_t all[64];
+	int nall = prime_factors_all(n, all);
 	int np = 0;
-	for (uint64_t i = 2; i <= n / i; i++) {
-		if (n % i == 0) {
-			p[np] = std::make_pair(i, 1);
-			n /= i;
-			while (n % i == 0) {
-				p[np].second++;
-				n /= i;
-			}
-			np++;
-		}
+	for (int i=0; i<nall; i++) {
+		if (np > 0 && p[np-1].first == all[i])
+			p[np-1].second++;
+		else
+			p[np++] = std::make_pair(all[i], 1);
 	}
-	if (n > 1)
-		p[np++] = std::make_pair(n, 1);
 	return np;
 }
 
@@ -62,3 +273,375 @@ std::vector<bool> prime_sieve(int n) {
 				pr[j] = 0;
 	return pr;
 }
+
+void MultFuncSieve::alloc(uint64_t sz) {
+	if (funcs & MF_PHI)
+		phi_tbl.assign(sz, 1);
+	if (funcs & MF_MU)
+		mu_tbl.assign(sz, 1);
+	if (funcs & MF_SIGMA)
+		sigma_tbl.assign(sz, 1);
+	if (funcs & MF_DIVISORS)
+		divisors_tbl.assign(sz, 1);
+}
+
+void MultFuncSieve::zero(uint64_t i) {
+	if (funcs & MF_PHI)
+		phi_tbl[i] = 0;
+	if (funcs & MF_MU)
+		mu_tbl[i] = 0;
+	if (funcs & MF_SIGMA)
+		sigma_tbl[i] = 0;
+	if (funcs & MF_DIVISORS)
+		divisors_tbl[i] = 0;
+}
+
+void MultFuncSieve::mul(uint32_t m, uint32_t a, uint32_t b) {
+	if (funcs & MF_PHI)
+		phi_tbl[m] = phi_tbl[a]*phi_tbl[b];
+	if (funcs & MF_MU)
+		mu_tbl[m] = mu_tbl[a]*mu_tbl[b];
+	if (funcs & MF_SIGMA)
+		sigma_tbl[m] = sigma_tbl[a]*sigma_tbl[b];
+	if (funcs & MF_DIVISORS)
+		divisors_tbl[m] = divisors_tbl[a]*divisors_tbl[b];
+}
+
+void MultFuncSieve::power(uint32_t m, uint32_t i, uint32_t p) {
+	if (funcs & MF_PHI)
+		phi_tbl[m] = i == 1 ? p-1 : phi_tbl[i]*p;
+	if (funcs & MF_MU)
+		mu_tbl[m] = i == 1 ? -1 : 0;
+	if (funcs & MF_SIGMA)
+		sigma_tbl[m] = sigma_tbl[i]*p+1;
+	if (funcs & MF_DIVISORS)
+		divisors_tbl[m] = divisors_tbl[i]+1;
+}
+
+void MultFuncSieve::mul_power(uint64_t i, uint32_t p, int e, uint64_t pk) {
+	if (funcs & MF_PHI)
+		phi_tbl[i] *= pk/p*(p-1);
+	if (funcs & MF_MU)
+		mu_tbl[i] = e > 1 ? 0 : -mu_tbl[i];
+	if (funcs & MF_SIGMA)
+		sigma_tbl[i] *= (pk*p-1)/(p-1);
+	if (funcs & MF_DIVISORS)
+		divisors_tbl[i] *= e+1;
+}
+
+std::vector<uint32_t> MultFuncSieve::sieving_primes(uint64_t hi) {
+	uint64_t root = std::sqrt((double)hi);
+	while (root*root > hi)
+		root--;
+	while ((root+1)*(root+1) <= hi)
+		root++;
+	auto pr = prime_sieve(root+1);
+	std::vector<uint32_t> res;
+	for (uint64_t p=2; p<=root; p++)
+		if (pr[p])
+			res.push_back(p);
+	return res;
+}
+
+/**
+ * Linear sieve, m = i*p is visited only for primes p <= smallest prime of i,
+ * pw[m] keeps the power of the smallest prime in m
+ */
+MultFuncSieve::MultFuncSieve(uint32_t n, int funcs):funcs(funcs),lo(0),hi(n) {
+	alloc(n);
+	if (n > 0)
+		zero(0);
+	std::vector<uint32_t> pw(n), primes;
+	for (uint64_t i=2; i<n; i++) {
+		if (pw[i] == 0) {
+			pw[i] = i;
+			power(i, 1, i);
+			primes.push_back(i);
+		}
+		for (uint64_t p:primes) {
+			const uint64_t m = i*p;
+			if (m >= n)
+				break;
+			if (i % p != 0) {
+				pw[m] = p;
+				mul(m, i, p);
+			} else {
+				pw[m] = pw[i]*p;
+				if (pw[m] == m)
+					power(m, i, p);
+				else
+					mul(m, m/pw[m], pw[m]);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Each sieving prime divides out its power from the numbers it hits,
+ * the cofactor left over > 1 is a single prime above sqrt(hi)
+ */
+MultFuncSieve::MultFuncSieve(uint64_t lo, uint64_t hi, int funcs, const std::vector<uint32_t> &sprimes):funcs(funcs),lo(lo),hi(std::max(lo, hi)) {
+	// the cofactors are kept in 32 bits
+	if (this->hi > (1ULL<<32))
+		throw std::out_of_range("MultFuncSieve: hi > 2^32");
+	const uint64_t sz = this->hi-lo;
+	alloc(sz);
+	std::vector<uint32_t> rem(sz);
+	for (uint64_t i=0; i<sz; i++)
+		rem[i] = lo+i;
+	for (uint64_t p:sprimes) {
+		if (p*p >= this->hi)
+			break;
+		for (uint64_t m=std::max(p, (lo+p-1)/p*p); m<this->hi; m+=p) {
+			uint32_t &r = rem[m-lo];
+			uint64_t pk = 1;
+			int e = 0;
+			do {
+				r /= p;
+				pk *= p;
+				e++;
+			} while (r % p == 0);
+			mul_power(m-lo, p, e, pk);
+		}
+	}
+	for (uint64_t i=0; i<sz; i++)
+		if (rem[i] > 1)
+			mul_power(i, rem[i], 1, rem[i]);
+	if (lo == 0 && sz > 0)
+		zero(0);
+}
+
+uint64_t MultFuncSieve::bytes() const {
+	return phi_tbl.size()*sizeof(phi_tbl[0])+mu_tbl.size()*sizeof(mu_tbl[0])
+		+sigma_tbl.size()*sizeof(sigma_tbl[0])+divisors_tbl.size()*sizeof(divisors_tbl[0]);
+}
+
+// numbers coprime to 30 within the wheel
+static const int wheel[8] = {1, 7, 11, 13, 17, 19, 23, 29};
+
+// bit of residue r in the byte, -1 for residues divisible by 2, 3 or 5
+static const int wheel_bit[30] = {
+	-1, 0, -1, -1, -1, -1, -1, 1, -1, -1, -1, 2, -1, 3, -1,
+	-1, -1, 4, -1, 5, -1, -1, -1, 6, -1, -1, -1, -1, -1, 7
+};
+
+// lowest set bit and number of set bits of a byte
+struct ByteBits {
+	uint8_t lowest[256];
+	uint8_t count[256];
+	ByteBits() {
+		count[0] = 0;
+		for (int b=1; b<256; b++) {
+			int i = 0;
+			while (!(b & (1<<i)))
+				i++;
+			lowest[b] = i;
+			count[b] = count[b&(b-1)]+1;
+		}
+	}
+};
+static const ByteBits byte_bits;
+
+/**
+ * Primes from 7 to sqrt(hi) needed to sieve up to hi
+ */
+std::vector<uint32_t> PrimeSegmentSieve::sieving_primes(uint64_t hi) {
+	uint64_t root = std::sqrt((double)hi);
+	while (root*root > hi)
+		root--;
+	while ((root+1)*(root+1) <= hi)
+		root++;
+	auto pr = prime_sieve(root+1);
+	std::vector<uint32_t> res;
+	for (uint64_t p=7; p<=root; p++)
+		if (pr[p])
+			res.push_back(p);
+	return res;
+}
+
+/**
+ * Segmented sieve of Eratosthenes on [lo, hi)
+ * The multiples p*q of sieving prime p with q coprime to 30 are crossed out.
+ * For a fixed q mod 30 they are 30*p apart, i.e. p bytes apart, and they
+ * always hit the same bit, so each prime runs 8 strided loops per segment
+ */
+PrimeSegmentSieve::PrimeSegmentSieve(uint64_t lo, uint64_t hi):PrimeSegmentSieve(lo, hi, sieving_primes(std::max(lo, hi))) {
+}
+
+PrimeSegmentSieve::PrimeSegmentSieve(uint64_t lo, uint64_t hi, const std::vector<uint32_t> &all_sprimes):lo(lo),hi(std::max(lo, hi)),seg_lo(lo/30),hi_byte((this->hi+29)/30),seg(segment_bytes) {
+	for (uint64_t p:all_sprimes) {
+		if (p*p >= this->hi)
+			break;
+		sprimes.push_back(p);
+		// first multiple p*q >= max(p*p, lo) for every residue of q
+		uint64_t q0 = std::max(p, (lo+p-1)/p);
+		for (int i=0; i<8; i++) {
+			uint64_t q = q0+(wheel[i]+30-q0%30)%30;
+			next_mult.push_back(p*q/30);
+		}
+	}
+}
+
+uint64_t PrimeSegmentSieve::sieve() {
+	const uint64_t seg_hi = std::min(seg_lo+segment_bytes, hi_byte);
+	const uint64_t seg_sz = seg_hi-seg_lo;
+	std::fill(seg.begin(), seg.begin()+seg_sz, 0xff);
+	if (seg_lo == 0)
+		seg[0] &= ~1; // 1 is not a prime
+	for (size_t k=0; k<sprimes.size(); k++) {
+		const uint64_t p = sprimes[k];
+		if (p*p >= seg_hi*30)
+			break;
+		for (int i=0; i<8; i++) {
+			uint64_t b = next_mult[8*k+i];
+			const uint8_t mask = ~(1 << wheel_bit[p*wheel[i]%30]);
+			for (; b < seg_hi; b += p)
+				seg[b-seg_lo] &= mask;
+			next_mult[8*k+i] = b;
+		}
+	}
+	return seg_sz;
+}
+
+bool PrimeSegmentSieve::next() {
+	found.clear();
+	if (seg_lo >= hi_byte)
+		return false;
+	const uint64_t seg_sz = sieve();
+	// 2, 3 and 5 are not on the wheel
+	if (seg_lo == 0)
+		for (uint64_t p:{2, 3, 5})
+			if (lo <= p && p < hi)
+				found.push_back(p);
+	for (uint64_t i=0; i<seg_sz; i++) {
+		for (unsigned bits=seg[i]; bits; bits&=bits-1) {
+			uint64_t n = (seg_lo+i)*30+wheel[byte_bits.lowest[bits]];
+			if (lo <= n && n < hi)
+				found.push_back(n);
+		}
+	}
+	seg_lo += seg_sz;
+	return true;
+}
+
+uint64_t PrimeSegmentSieve::count() {
+	uint64_t cnt = 0;
+	found.clear();
+	while (seg_lo < hi_byte) {
+		const uint64_t seg_sz = sieve();
+		if (seg_lo == 0)
+			for (uint64_t p:{2, 3, 5})
+				if (lo <= p && p < hi)
+					cnt++;
+		for (uint64_t i=0; i<seg_sz; i++) {
+			uint64_t base = (seg_lo+i)*30;
+			if (lo <= base && base+30 <= hi) {
+				cnt += byte_bits.count[seg[i]];
+			} else {
+				// partial block at the range edges
+				for (unsigned bits=seg[i]; bits; bits&=bits-1) {
+					uint64_t n = base+wheel[byte_bits.lowest[bits]];
+					if (lo <= n && n < hi)
+						cnt++;
+				}
+			}
+		}
+		seg_lo += seg_sz;
+	}
+	return cnt;
+}
+
+/**
+ * Lucy Hedgehog's prime counting in O(n^3/4) time and O(sqrt(n)) memory
+ * S(v) - number of integers in [2, v] which survived sieving by the primes < p,
+ * only v = n/i values are needed. Sieving by p removes
+ * S(v/p) - S(p-1) numbers with the smallest prime factor p
+ */
+uint64_t prime_pi(uint64_t n) {
+	if (n < 2)
+		return 0;
+	uint64_t r = std::sqrt((double)n);
+	while (r*r > n)
+		r--;
+	while ((r+1)*(r+1) <= n)
+		r++;
+	// small[v] = S(v), large[i] = S(n/i)
+	std::vector<uint64_t> small(r+1), large(r+1);
+	for (uint64_t v=1; v<=r; v++) {
+		small[v] = v-1;
+		large[v] = n/v-1;
+	}
+	for (uint64_t p=2; p<=r; p++) {
+		if (small[p] == small[p-1])
+			continue; // not a prime
+		const uint64_t sp = small[p-1];
+		const uint64_t p2 = p*p;
+		const uint64_t imax = std::min(r, n/p2);
+		for (uint64_t i=1; i<=imax; i++) {
+			uint64_t d = i*p;
+			large[i] -= (d <= r ? large[d] : small[n/d]) - sp;
+		}
+		for (uint64_t v=r; v>=p2; v--)
+			small[v] -= small[v/p] - sp;
+	}
+	return large[1];
+}
+
+/**
+ * Linear sieve on odd numbers only. Every odd composite m is crossed out once
+ * as p*i where p is its smallest prime factor and i is odd with spf(i) >= p
+ */
+SpfTable::SpfTable(uint32_t limit):limit(limit),spf((limit+1)/2) {
+	std::vector<uint32_t> primes;
+	if (!spf.empty())
+		spf[0] = 1;
+	for (uint64_t i=3; i<limit; i+=2) {
+		uint32_t &s = spf[i >> 1];
+		if (s == 0) {
+			s = i;
+			primes.push_back(i);
+		}
+		for (uint64_t p:primes) {
+			if (p > s || i*p >= limit)
+				break;
+			spf[(i*p) >> 1] = p;
+		}
+	}
+}
+
+int SpfTable::factors_all(uint32_t n, uint32_t p[]) const {
+	int np = 0;
+	while (!(n & 1) && n > 0) {
+		p[np++] = 2;
+		n >>= 1;
+	}
+	while (n > 1) {
+		uint32_t f = spf[n >> 1];
+		p[np++] = f;
+		n /= f;
+	}
+	return np;
+}
+
+int SpfTable::factors_uniq(uint32_t n, std::pair<uint32_t,int> p[]) const {
+	int np = 0;
+	if (!(n & 1) && n > 0) {
+		p[np] = std::make_pair(2U, 0);
+		while (!(n & 1)) {
+			p[np].second++;
+			n >>= 1;
+		}
+		np++;
+	}
+	while (n > 1) {
+		uint32_t f = spf[n >> 1];
+		p[np] = std::make_pair(f, 0);
+		while (n % f == 0) {
+			p[np].second++;
+			n /= f;
+		}
+		np++;
+	}
+	return np;
+}
@@ -0,0 +1,210 @@
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <cstdint>
+#include "gtest/gtest.h"
+#include "coro.hpp"
+#include "par.hpp"
+#include "pipe.hpp"
+
+/**
+ * Usage example
+ */
+
+CoroTask generate(int64_t n, CoroChannel<int64_t> &out) {
+	for (int64_t i=0; i<n; i++)
+		if (!co_await out.push(i))
+			break;
+	out.close();
+}
+
+CoroTask increment(CoroChannel<int64_t> &in, CoroChannel<int64_t> &out) {
+	while (auto v = co_await in.pop()) {
+		if (!co_await out.push(*v+1)) {
+			in.close();	// consumer quit, stop the producer as well
+			break;
+		}
+	}
+	out.close();
+}
+
+CoroTask accumulate(CoroChannel<int64_t> &in, int64_t &cnt, int64_t &sum, bool &ordered) {
+	int64_t prev = -1;
+	while (auto v = co_await in.pop()) {
+		ordered &= (prev < *v);
+		prev = *v;
+		sum += *v;
+		cnt++;
+	}
+}
+
+// n numbers through the chain of stages increments, returns the elapsed time
+static double run_coro(int64_t n, int stages, int nthreads, int64_t &cnt, int64_t &sum, bool &ordered) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	CoroExecutor exec(nthreads);
+	std::vector<std::unique_ptr<CoroChannel<int64_t>>> ch;
+	for (int i=0; i<=stages; i++)
+		ch.emplace_back(new CoroChannel<int64_t>(exec));
+	cnt = sum = 0;
+	ordered = true;
+	exec.spawn(accumulate(*ch[stages], cnt, sum, ordered));
+	for (int i=stages; i>0; i--)
+		exec.spawn(increment(*ch[i-1], *ch[i]));
+	exec.spawn(generate(n, *ch[0]));
+	exec.wait();
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> d = end-start;
+	return d.count();
+}
+
+TEST(CoroTest, Simple) {
+	constexpr int64_t n = 10000;
+	for (int stages:{1, 2, 20}) {
+		for (int nthreads:{1, 2, 4}) {
+			int64_t cnt, sum;
+			bool ordered;
+			run_coro(n, stages, nthreads, cnt, sum, ordered);
+			EXPECT_EQ(n, cnt);
+			EXPECT_EQ(n*(n-1)/2+n*stages, sum);
+			EXPECT_TRUE(ordered);
+		}
+	}
+}
+
+CoroTask take(CoroChannel<int64_t> &in, int64_t limit, int64_t &cnt) {
+	while (cnt < limit) {
+		auto v = co_await in.pop();
+		if (!v)
+			break;
+		cnt++;
+	}
+	in.close();	// tell the producers to stop
+}
+
+TEST(CoroTest, EarlyClose) {
+	CoroExecutor exec(2);
+	CoroChannel<int64_t> ch0(exec), ch1(exec);
+	int64_t cnt = 0;
+	exec.spawn(take(ch1, 100, cnt));
+	exec.spawn(increment(ch0, ch1));
+	exec.spawn(generate(std::numeric_limits<int64_t>::max(), ch0));
+	exec.wait();
+	EXPECT_EQ(100, cnt);
+}
+
+TEST(CoroTest, ZeroCapacity) {
+	CoroExecutor exec(3);
+	CoroChannel<int64_t> ch0(exec, 0), ch1(exec, 0);
+	int64_t cnt = 0, sum = 0;
+	bool ordered = true;
+	exec.spawn(accumulate(ch1, cnt, sum, ordered));
+	exec.spawn(increment(ch0, ch1));
+	exec.spawn(generate(1000, ch0));
+	exec.wait();
+	EXPECT_EQ(1000, cnt);
+	EXPECT_EQ(1000*999/2+1000, sum);
+	EXPECT_TRUE(ordered);
+}
+
+/**
+ * The same chain on thread-per-stage conveyors
+ */
+
+class TGen: public PipeHead<int64_t> {
+	int64_t n, i;
+	virtual bool next(int64_t &out) override {
+		out = i++;
+		return out < n;
+	}
+public:
+	TGen(int64_t n):PipeHead(),n(n),i(0) {
+	}
+};
+
+class TInc: public PipeStage<int64_t, int64_t> {
+	virtual int64_t next(int64_t &&v) override {
+		return v+1;
+	}
+public:
+	using PipeStage::PipeStage;
+};
+
+class LGen: public PipeHeadExec {
+	int64_t n;
+	std::vector<int64_t> el;
+	virtual void *next() override {
+		if (batch < n) {
+			int64_t &e = el[batch%el.size()];
+			e = batch;
+			return &e;
+		} else {
+			return nullptr;
+		}
+	}
+public:
+	LGen(int64_t n, int chunk):PipeHeadExec(chunk),n(n),el(2*chunk) {
+	}
+};
+
+class LInc: public PipeStageExec {
+	std::vector<int64_t> el;
+	virtual void *next(void *arg) override {
+		int64_t &e = el[batch%el.size()];
+		e = *(int64_t*)arg+1;
+		return &e;
+	}
+public:
+	LInc(PipeHeadExec &parent):PipeStageExec(parent),el(2*chunk) {
+	}
+};
+
+TEST(CoroTest, Performance) {
+	constexpr int64_t n = 20000;
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	std::chrono::duration<double> d;
+	for (int stages:{2, 8, 20, 50}) {
+		int64_t cnt, sum;
+		bool ordered;
+		double coro = run_coro(n, stages, 2, cnt, sum, ordered);
+		EXPECT_EQ(n*(n-1)/2+n*stages, sum);
+		start = std::chrono::system_clock::now();
+		{
+			TGen gen(n);
+			std::vector<std::unique_ptr<TInc>> inc;
+			for (int i=0; i<stages; i++)
+				inc.emplace_back(new TInc(i ? (PipeHead<int64_t>&)*inc.back() : gen));
+			sum = 0;
+			for (auto v:PipeSink<int64_t>(*inc.back()))
+				sum += v;
+			EXPECT_EQ(n*(n-1)/2+n*stages, sum);
+			while (!inc.empty())
+				inc.pop_back();	// consumers must go first
+		}
+		end = std::chrono::system_clock::now();
+		d = end-start;
+		double typed = d.count();
+		start = std::chrono::system_clock::now();
+		{
+			LGen gen(n, 64);
+			std::vector<std::unique_ptr<LInc>> inc;
+			for (int i=0; i<stages; i++)
+				inc.emplace_back(new LInc(i ? (PipeHeadExec&)*inc.back() : gen));
+			LInc &tail = *inc.back();
+			sum = 0;
+			for (auto v:PipeOutput(tail))
+				sum += *(int64_t*)v;
+			EXPECT_EQ(n*(n-1)/2+n*stages, sum);
+			while (!inc.empty())
+				inc.pop_back();
+		}
+		end = std::chrono::system_clock::now();
+		d = end-start;
+		double lockstep = d.count();
+		std::cerr << "[          ] stages=" << stages
+			<< " coroutines on 2 threads " << n/coro << " items/sec"
+			<< ", thread per stage typed " << n/typed << " items/sec"
+			<< ", lock-step chunk=64 " << n/lockstep << " items/sec" << std::endl;
+	}
+}
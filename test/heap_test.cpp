@@ -1,9 +1,12 @@
 #include "heap.hpp"
+#include "par_heap.hpp"
 #include "gtest/gtest.h"
 #include <vector>
 #include <memory>
 #include <algorithm>
 #include <chrono>
+#include <queue>
+#include <cstdint>
 
 template<typename T> bool test_sort(T *begin, T *end) {
 	std::vector<T> s(begin, end);
@@ -82,4 +85,327 @@ TEST(HeapTest, Performance) {
 	std::chrono::duration<double> ours = end-start;
 	std::cerr << "[			 ] our heap sort performance = " << ours.count() << std::endl;
 	EXPECT_TRUE(stock.count() * 1.1 > ours.count());	// ours must be no slower than 10%
+	for (auto &bi:b)
+		bi = rand();
+	start = std::chrono::system_clock::now();
+	dary_heapsort<4>(&b[0], &b[sz]);
+	end = std::chrono::system_clock::now();
+	EXPECT_TRUE(std::is_sorted(&b[0], &b[sz], std::greater<int>()));
+	std::chrono::duration<double> dary4 = end-start;
+	std::cerr << "[			 ] our 4-ary heap sort performance = " << dary4.count() << std::endl;
+	for (auto &bi:b)
+		bi = rand();
+	start = std::chrono::system_clock::now();
+	dary_heapsort<8>(&b[0], &b[sz]);
+	end = std::chrono::system_clock::now();
+	EXPECT_TRUE(std::is_sorted(&b[0], &b[sz], std::greater<int>()));
+	std::chrono::duration<double> dary8 = end-start;
+	std::cerr << "[			 ] our 8-ary heap sort performance = " << dary8.count() << std::endl;
+}
+
+template<int D, typename T> bool test_dary_sort(std::vector<T> a) {
+	std::vector<T> s(a);
+	dary_heapify<D>(a.begin(), a.end());
+	for (size_t i=1; i<a.size(); i++)
+		if (a[i] < a[(i-1)/D])
+			return false;
+	dary_heapsort<D>(a.begin(), a.end());
+	std::sort(s.begin(), s.end(), std::greater<T>());
+	return s == a;
+}
+
+TEST(HeapTest, Dary) {
+	for (int sz=0; sz<300; sz++) {
+		std::vector<int> a(sz);
+		for (auto &ai:a)
+			ai = rand() % 50 - 25;
+		EXPECT_TRUE(test_dary_sort<2>(a));
+		EXPECT_TRUE(test_dary_sort<4>(a));
+		EXPECT_TRUE(test_dary_sort<8>(a));
+		std::vector<double> d(a.begin(), a.end());
+		EXPECT_TRUE(test_dary_sort<4>(d));
+		// simd path on raw pointers
+		std::vector<int> b(a), c(a);
+		dary_heapsort<4>(b.data(), b.data()+sz);
+		dary_heapsort<8>(c.data(), c.data()+sz);
+		std::sort(a.begin(), a.end(), std::greater<int>());
+		EXPECT_EQ(a, b);
+		EXPECT_EQ(a, c);
+	}
+	int e[] = {INT32_MIN, INT32_MAX, 0, -1, INT32_MAX, INT32_MIN, 5, 5, 5};
+	dary_heapsort<8>(e, e+dim(e));
+	EXPECT_TRUE(std::is_sorted(e, e+dim(e), std::greater<int>()));
+}
+
+template<typename T> bool is_min_heap(const std::vector<T> &v) {
+	for (size_t i=1; i<v.size(); i++)
+		if (v[i] < v[(i-1)/2])
+			return false;
+	return true;
+}
+
+TEST(HeapTest, ParHeapify) {
+	for (int nthreads:{1, 2, 3, 8}) {
+		ParHeap<std::vector<int>::iterator> ph(nthreads);
+		for (int sz:{0, 1, 100, 1<<14, (1<<14)+1, 100003, 1<<18}) {
+			std::vector<int> a(sz);
+			for (auto &ai:a)
+				ai = rand() % 1000;
+			std::vector<int> s(a);
+			ph.heapify(a.begin(), a.end());
+			EXPECT_TRUE(is_min_heap(a));
+			std::sort(s.begin(), s.end());
+			std::sort(a.begin(), a.end());
+			EXPECT_EQ(s, a);
+		}
+	}
+}
+
+TEST(HeapTest, ParHeapsort) {
+	for (int nthreads:{1, 2, 3, 5, 8}) {
+		ParHeap<long*> ph(nthreads);
+		for (int sz:{0, 1, 2, 1000, 1<<14, (1<<14)+7, 100003}) {
+			std::unique_ptr<long[]> a(new long[sz]);
+			for (int i=0; i<sz; i++)
+				a[i] = rand();
+			std::vector<long> s(&a[0], &a[0]+sz);
+			ph.sort(&a[0], &a[0]+sz);
+			std::sort(s.begin(), s.end(), std::greater<long>());
+			EXPECT_TRUE(std::equal(s.begin(), s.end(), &a[0]));
+		}
+	}
+	std::vector<int> b(200000, 7);
+	par_heapsort(b.begin(), b.end(), 4);
+	EXPECT_TRUE(std::all_of(b.begin(), b.end(), [](int x){ return x == 7; }));
+}
+
+template<class F> static double seconds(F f) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	f();
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> d = end-start;
+	return d.count();
+}
+
+TEST(HeapTest, ParPerformance) {
+	const int nthreads = std::max(4U, std::thread::hardware_concurrency());
+	for (int sz:{1000000, 10000000}) {
+		std::vector<int> a(sz), b(sz);
+		for (auto &ai:a)
+			ai = rand();
+		b = a;
+		double t_make_heap = seconds([&]{ std::make_heap(b.begin(), b.end(), std::greater<int>()); });
+		b = a;
+		double t_heapify = seconds([&]{ heapify(b.begin(), b.end()); });
+		b = a;
+		double t_par_heapify = seconds([&]{ par_heapify(b.begin(), b.end(), nthreads); });
+		EXPECT_TRUE(is_min_heap(b));
+		b = a;
+		double t_sort = seconds([&]{ std::sort(b.begin(), b.end(), std::greater<int>()); });
+		b = a;
+		double t_heapsort = seconds([&]{ heapsort(b.begin(), b.end()); });
+		b = a;
+		double t_par_heapsort = seconds([&]{ par_heapsort(b.begin(), b.end(), nthreads); });
+		EXPECT_TRUE(std::is_sorted(b.begin(), b.end(), std::greater<int>()));
+		std::cerr << "[          ] n=" << sz << " threads=" << nthreads
+			<< " make_heap=" << t_make_heap << " heapify=" << t_heapify << " par_heapify=" << t_par_heapify
+			<< " std::sort=" << t_sort << " heapsort=" << t_heapsort << " par_heapsort=" << t_par_heapsort << std::endl;
+	}
+}
+
+TEST(HeapTest, IndexedHeap) {
+	constexpr int n = 1000;
+	IndexedHeap<int> q(n);
+	std::vector<int> ref(n, -1);	// reference keys, -1 if absent
+	for (int step=0; step<100000; step++) {
+		int h = rand() % n;
+		int op = rand() % 4;
+		if (op == 0 && !q.contains(h)) {
+			int k = rand() % 10000;
+			q.push(h, k);
+			ref[h] = k;
+		} else if (op == 1 && q.contains(h)) {
+			int k = rand() % (q.key(h)+1);
+			q.decrease(h, k);
+			ref[h] = k;
+		} else if (op == 2 && q.contains(h)) {
+			q.erase(h);
+			ref[h] = -1;
+		} else if (op == 3 && !q.empty()) {
+			int t = q.top();
+			for (int i=0; i<n; i++)
+				EXPECT_TRUE(ref[i] < 0 || ref[t] <= ref[i]);
+			q.pop();
+			ref[t] = -1;
+		}
+		ASSERT_EQ(std::count_if(ref.begin(), ref.end(), [](int k){ return k >= 0; }), (long)q.size());
+	}
+	IndexedHeap<double, std::greater<double>, 2> mx(3);
+	mx.push(0, 1.5);
+	mx.push(1, 2.5);
+	mx.push(2, 0.5);
+	EXPECT_FALSE(mx.push_or_decrease(2, 0.25));
+	EXPECT_TRUE(mx.push_or_decrease(2, 3.5));
+	EXPECT_EQ(2U, mx.top());
+}
+
+TEST(HeapTest, RadixHeap) {
+	RadixHeap<int> q;
+	std::vector<uint64_t> popped;
+	uint64_t last = 0;
+	for (int step=0; step<100000; step++) {
+		if (rand() % 3 && q.size() < 1000) {
+			uint64_t k = last + (uint64_t(rand()) << (rand() % 32));
+			q.push(k, step);
+		} else if (!q.empty()) {
+			last = q.top().first;
+			popped.push_back(last);
+			q.pop();
+		}
+	}
+	EXPECT_TRUE(std::is_sorted(popped.begin(), popped.end()));
+}
+
+// random graph with n vertices and m out-edges per vertex, weights in [1, wmax]
+struct Graph {
+	std::vector<size_t> first;	// edges of v are [first[v], first[v+1])
+	std::vector<std::pair<size_t, uint32_t>> edges;
+	Graph(size_t n, int m, uint32_t wmax):first(n+1) {
+		edges.reserve(n*m);
+		for (size_t v=0; v<n; v++) {
+			first[v] = edges.size();
+			edges.emplace_back((v+1)%n, 1+rand()%wmax);	// keep it connected
+			for (int e=1; e<m; e++)
+				edges.emplace_back(size_t(rand())%n, 1+rand()%wmax);
+		}
+		first[n] = edges.size();
+	}
+	size_t size() const {
+		return first.size()-1;
+	}
+};
+
+static std::vector<uint64_t> dijkstra_std(const Graph &g, size_t src) {
+	std::vector<uint64_t> dist(g.size(), UINT64_MAX);
+	typedef std::pair<uint64_t, size_t> KV;
+	std::priority_queue<KV, std::vector<KV>, std::greater<KV>> q;
+	dist[src] = 0;
+	q.emplace(0, src);
+	while (!q.empty()) {
+		KV kv = q.top();
+		q.pop();
+		if (kv.first > dist[kv.second])
+			continue;	// stale
+		for (size_t e=g.first[kv.second]; e<g.first[kv.second+1]; e++) {
+			uint64_t d = kv.first+g.edges[e].second;
+			if (d < dist[g.edges[e].first]) {
+				dist[g.edges[e].first] = d;
+				q.emplace(d, g.edges[e].first);
+			}
+		}
+	}
+	return dist;
+}
+
+static std::vector<uint64_t> dijkstra_indexed(const Graph &g, size_t src) {
+	std::vector<uint64_t> dist(g.size(), UINT64_MAX);
+	IndexedHeap<uint64_t> q(g.size());
+	dist[src] = 0;
+	q.push(src, 0);
+	while (!q.empty()) {
+		size_t v = q.top();
+		q.pop();
+		for (size_t e=g.first[v]; e<g.first[v+1]; e++) {
+			uint64_t d = dist[v]+g.edges[e].second;
+			size_t u = g.edges[e].first;
+			if (d < dist[u]) {
+				dist[u] = d;
+				q.push_or_decrease(u, d);
+			}
+		}
+	}
+	return dist;
+}
+
+static std::vector<uint64_t> dijkstra_radix(const Graph &g, size_t src) {
+	std::vector<uint64_t> dist(g.size(), UINT64_MAX);
+	RadixHeap<size_t> q;
+	dist[src] = 0;
+	q.push(0, src);
+	while (!q.empty()) {
+		std::pair<uint64_t, size_t> kv = q.top();
+		q.pop();
+		if (kv.first > dist[kv.second])
+			continue;	// stale
+		for (size_t e=g.first[kv.second]; e<g.first[kv.second+1]; e++) {
+			uint64_t d = kv.first+g.edges[e].second;
+			if (d < dist[g.edges[e].first]) {
+				dist[g.edges[e].first] = d;
+				q.push(d, g.edges[e].first);
+			}
+		}
+	}
+	return dist;
+}
+
+TEST(HeapTest, DijkstraPerformance) {
+	for (size_t n:{1000, 1<<20}) {
+		Graph g(n, 8, 1000);
+		std::vector<uint64_t> d_std, d_idx, d_rad;
+		double t_std = seconds([&]{ d_std = dijkstra_std(g, 0); });
+		double t_idx = seconds([&]{ d_idx = dijkstra_indexed(g, 0); });
+		double t_rad = seconds([&]{ d_rad = dijkstra_radix(g, 0); });
+		EXPECT_EQ(d_std, d_idx);
+		EXPECT_EQ(d_std, d_rad);
+		std::cerr << "[          ] dijkstra n=" << n << " m=" << g.edges.size()
+			<< " std::priority_queue=" << t_std << " IndexedHeap=" << t_idx << " RadixHeap=" << t_rad << std::endl;
+	}
+}
+
+struct Record {
+	int id;
+	double score;
+	char payload[48];
+};
+
+struct ByScore {
+	const double &operator()(const Record &r) const {
+		return r.score;
+	}
+};
+
+TEST(HeapTest, Projection) {
+	std::vector<Record> a(1000);
+	for (int i=0; i<(int)a.size(); i++)
+		a[i] = Record {i, double(rand() % 100), {}};
+	std::vector<Record> b(a), c(a);
+	heapsort(a.begin(), a.end(), Less(), ByScore());
+	EXPECT_TRUE(std::is_sorted(a.begin(), a.end(), [](const Record &x, const Record &y){ return x.score > y.score; }));
+	dary_heapsort<4>(b.begin(), b.end(), Less(), ByScore());
+	EXPECT_TRUE(std::is_sorted(b.begin(), b.end(), [](const Record &x, const Record &y){ return x.score > y.score; }));
+	// reverse order by id with custom comparator
+	heapsort(c.begin(), c.end(), std::greater<int>(), [](const Record &r){ return r.id; });
+	for (int i=0; i<(int)c.size(); i++)
+		EXPECT_EQ(i, c[i].id);
+	std::vector<int> d {5, 1, 4, 2, 3};
+	dary_heapsort<8>(&d[0], &d[0]+d.size(), std::greater<int>(), Identity());
+	EXPECT_TRUE(std::is_sorted(d.begin(), d.end()));
+}
+
+TEST(HeapTest, ParProjection) {
+	for (int nthreads:{1, 3, 4}) {
+		std::vector<Record> a(100003);
+		for (int i=0; i<(int)a.size(); i++)
+			a[i] = Record {i, double(rand() % 1000), {}};
+		std::vector<Record> b(a);
+		par_heapsort(a.begin(), a.end(), nthreads, Less(), ByScore());
+		EXPECT_TRUE(std::is_sorted(a.begin(), a.end(), [](const Record &x, const Record &y){ return x.score > y.score; }));
+		par_heapify(b.begin(), b.end(), nthreads, std::greater<int>(), [](const Record &r){ return r.id; });
+		for (size_t i=1; i<b.size(); i++)
+			if (b[i].id > b[(i-1)/2].id) {
+				ADD_FAILURE() << "not a max-heap at " << i;
+				break;
+			}
+	}
 }
@@ -1,5 +1,11 @@
 #include "nth_element.hpp"
+#include "par_select.hpp"
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <string>
 
 TEST(NthElement, NthElementSimple) {
 	std::vector<int> data {1,2,3,4,5,6,7,8,9};
@@ -37,3 +43,300 @@ TEST(NthElement, NthElementVsNthElement) {
 		EXPECT_EQ(data_std[iter], data[iter]);
 	}
 }
+
+TEST(NthElement, Partition3wayIterators) {
+	for (int iter=0; iter<256; iter++) {
+		int sz = 1+std::rand()%100;
+		std::deque<int> data(sz);
+		for (auto &d:data)
+			d = std::rand()%10;
+		int pivot = data.back();
+		Range r = partition3way(data.begin(), data.end());
+		for (size_t i=0; i<(size_t)sz; i++) {
+			if (i < r.begin)
+				EXPECT_LT(data[i], pivot);
+			else if (i < r.end)
+				EXPECT_EQ(data[i], pivot);
+			else
+				EXPECT_GT(data[i], pivot);
+		}
+	}
+	int a[] = {3, 1, 2, 3, 5, 3};
+	Range r = partition3way(a+1, a+6);	// pivot 3
+	EXPECT_EQ(2U, r.begin);
+	EXPECT_EQ(4U, r.end);
+	EXPECT_EQ(3, a[0]);
+}
+
+struct Item {
+	int key;
+	int value;
+};
+
+TEST(NthElement, ComparatorProjection) {
+	for (int iter=0; iter<256; iter++) {
+		int sz = 1+std::rand()%200;
+		std::vector<Item> data(sz);
+		for (int i=0; i<sz; i++)
+			data[i] = Item {std::rand()%50, i};
+		int k = std::rand()%sz;
+		std::vector<int> keys(sz);
+		for (int i=0; i<sz; i++)
+			keys[i] = data[i].key;
+		std::nth_element(keys.begin(), keys.begin()+k, keys.end(), std::greater<int>());
+		my_nth_element(data, k, std::greater<int>(), [](const Item &it){ return it.key; });
+		EXPECT_EQ(keys[k], data[k].key);
+		for (int i=0; i<k; i++)
+			EXPECT_GE(data[i].key, data[k].key);
+		for (int i=k+1; i<sz; i++)
+			EXPECT_LE(data[i].key, data[k].key);
+	}
+	int a[] = {9, 8, 7, 6, 5, 4, 3, 2, 1};
+	my_nth_element(a, a+2, a+9);
+	EXPECT_EQ(3, a[2]);
+}
+
+enum Pattern {
+	SORTED,
+	REVERSE,
+	ORGAN_PIPE,
+	RANDOM,
+	DUPLICATES
+};
+
+static const char *pattern_names[] = {"sorted", "reverse", "organ pipe", "random", "duplicates"};
+
+static std::vector<int> make_pattern(Pattern p, int sz) {
+	std::vector<int> data(sz);
+	for (int i=0; i<sz; i++) {
+		switch (p) {
+		case SORTED:
+			data[i] = i;
+			break;
+		case REVERSE:
+			data[i] = sz-i;
+			break;
+		case ORGAN_PIPE:
+			data[i] = std::min(i, sz-i);
+			break;
+		case RANDOM:
+			data[i] = std::rand();
+			break;
+		case DUPLICATES:
+			data[i] = std::rand()%16;
+			break;
+		}
+	}
+	return data;
+}
+
+TEST(NthElement, IntroselectPatterns) {
+	for (auto p:{SORTED, REVERSE, ORGAN_PIPE, RANDOM, DUPLICATES}) {
+		for (int sz:{1, 2, 17, 100, 1000, 10007}) {
+			for (int bad:{4, 0}) {
+				std::vector<int> data = make_pattern(p, sz);
+				std::vector<int> exp(data);
+				std::sort(exp.begin(), exp.end());
+				int k = std::rand()%sz;
+				// bad = 0 takes median of medians pivots right away
+				introselect(data.begin(), data.begin()+k, data.end(), Less(), Identity(), bad);
+				ASSERT_EQ(exp[k], data[k]) << pattern_names[p] << " size=" << sz << " bad=" << bad;
+				for (int i=0; i<k; i++)
+					ASSERT_LE(data[i], data[k]);
+				for (int i=k+1; i<sz; i++)
+					ASSERT_GE(data[i], data[k]);
+			}
+		}
+	}
+	std::vector<int> empty;
+	my_nth_element(empty.begin(), empty.begin(), empty.end());
+}
+
+TEST(NthElement, IntroselectPerformance) {
+	const int sz = 10000000;
+	for (auto p:{SORTED, REVERSE, ORGAN_PIPE, RANDOM, DUPLICATES}) {
+		std::vector<int> data = make_pattern(p, sz);
+		std::vector<int> data_std(data), data_mom(data);
+		std::chrono::time_point<std::chrono::system_clock> start, end;
+		start = std::chrono::system_clock::now();
+		std::nth_element(data_std.begin(), data_std.begin()+sz/2, data_std.end());
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> std_time = end-start;
+		start = std::chrono::system_clock::now();
+		my_nth_element(data, sz/2);
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> ours = end-start;
+		start = std::chrono::system_clock::now();
+		introselect(data_mom.begin(), data_mom.begin()+sz/2, data_mom.end(), Less(), Identity(), 0);
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> mom = end-start;
+		EXPECT_EQ(data_std[sz/2], data[sz/2]);
+		EXPECT_EQ(data_std[sz/2], data_mom[sz/2]);
+		std::cerr << "[          ] " << pattern_names[p] << ": std::nth_element = " << std_time.count()
+			<< " my_nth_element = " << ours.count() << " median of medians only = " << mom.count() << " sec" << std::endl;
+	}
+}
+
+TEST(NthElement, Partition3wayBlock) {
+	for (int iter=0; iter<512; iter++) {
+		int sz = 1+std::rand()%1000;
+		int range = 1+std::rand()%(iter%2 ? 10 : 100000);
+		std::deque<int> data(sz);
+		for (auto &d:data)
+			d = std::rand()%range;
+		std::deque<int> orig(data);
+		int pivot = data.back();
+		Range r = partition3way_block(data.begin(), data.end());
+		for (size_t i=0; i<(size_t)sz; i++) {
+			if (i < r.begin)
+				ASSERT_LT(data[i], pivot);
+			else if (i < r.end)
+				ASSERT_EQ(data[i], pivot);
+			else
+				ASSERT_GT(data[i], pivot);
+		}
+		std::sort(orig.begin(), orig.end());
+		std::sort(data.begin(), data.end());
+		ASSERT_EQ(orig, data);
+	}
+	std::vector<Item> items {{3, 0}, {1, 1}, {5, 2}, {3, 3}};
+	Range r = partition3way_block(items.begin(), items.end(), std::greater<int>(), [](const Item &it){ return it.key; });
+	EXPECT_EQ(1U, r.begin);
+	EXPECT_EQ(3U, r.end);
+	EXPECT_EQ(5, items[0].key);
+	EXPECT_EQ(1, items[3].key);
+}
+
+TEST(NthElement, Partition3wayBlockPerformance) {
+	const int sz = 10000000;
+	for (auto p:{RANDOM, DUPLICATES}) {
+		std::vector<int> data = make_pattern(p, sz);
+		data.back() = p == RANDOM ? RAND_MAX/2 : 8;
+		std::vector<int> data_block(data);
+		std::chrono::time_point<std::chrono::system_clock> start, end;
+		start = std::chrono::system_clock::now();
+		Range r = partition3way(data.begin(), data.end());
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> branchy = end-start;
+		start = std::chrono::system_clock::now();
+		Range rb = partition3way_block(data_block.begin(), data_block.end());
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> block = end-start;
+		EXPECT_EQ(r.begin, rb.begin);
+		EXPECT_EQ(r.end, rb.end);
+		std::cerr << "[          ] " << pattern_names[p] << ": partition3way = " << branchy.count()
+			<< " partition3way_block = " << block.count() << " sec" << std::endl;
+	}
+}
+
+TEST(NthElement, ParPartition) {
+	for (int sz:{1, 1000, 100000, 1000003}) {
+		for (auto p:{RANDOM, DUPLICATES, SORTED}) {
+			std::vector<int> data = make_pattern(p, sz);
+			std::vector<int> exp(data);
+			Range re = partition3way_block(exp.begin(), exp.end());
+			for (int nthreads:{1, 3, 8}) {
+				std::vector<int> res(data);
+				Range r = par_partition3way(res.begin(), res.end(), nthreads);
+				ASSERT_EQ(re.begin, r.begin) << pattern_names[p] << " size=" << sz << " nthreads=" << nthreads;
+				ASSERT_EQ(re.end, r.end);
+				int pivot = data.back();
+				for (size_t i=0; i<size_t(sz); i++) {
+					if (i < r.begin)
+						ASSERT_LT(res[i], pivot);
+					else if (i < r.end)
+						ASSERT_EQ(res[i], pivot);
+					else
+						ASSERT_GT(res[i], pivot);
+				}
+				std::sort(res.begin(), res.end());
+				std::vector<int> sorted(data);
+				std::sort(sorted.begin(), sorted.end());
+				ASSERT_EQ(sorted, res);
+			}
+		}
+	}
+}
+
+TEST(NthElement, ParNthElement) {
+	for (int sz:{1, 1000, 1000003}) {
+		for (auto p:{SORTED, REVERSE, ORGAN_PIPE, RANDOM, DUPLICATES}) {
+			std::vector<int> data = make_pattern(p, sz);
+			std::vector<int> sorted(data);
+			std::sort(sorted.begin(), sorted.end());
+			for (int nthreads:{1, 4}) {
+				std::vector<int> res(data);
+				int k = std::rand()%sz;
+				par_nth_element(res.begin(), res.begin()+k, res.end(), nthreads);
+				ASSERT_EQ(sorted[k], res[k]) << pattern_names[p] << " size=" << sz << " nthreads=" << nthreads;
+				for (int i=0; i<sz; i+=97) {
+					if (i < k)
+						ASSERT_LE(res[i], res[k]);
+					else
+						ASSERT_GE(res[i], res[k]);
+				}
+				res = data;
+				std::vector<double> ps{0.5, 0.9, 0.99, 0.0, 1.0, 0.5};
+				std::vector<int> pc = par_percentiles(res.begin(), res.end(), ps, nthreads);
+				ASSERT_EQ(ps.size(), pc.size());
+				for (size_t i=0; i<ps.size(); i++) {
+					size_t rank = ps[i]*(sz-1);
+					EXPECT_EQ(sorted[rank], pc[i]) << "p=" << ps[i];
+					EXPECT_EQ(sorted[rank], res[rank]) << "p=" << ps[i];
+				}
+			}
+		}
+	}
+	std::vector<Item> items(200000);
+	for (int i=0; i<int(items.size()); i++)
+		items[i] = Item {std::rand()%1000, i};
+	auto key = [](const Item &it){ return it.key; };
+	std::vector<int> keys(items.size());
+	for (size_t i=0; i<items.size(); i++)
+		keys[i] = items[i].key;
+	std::nth_element(keys.begin(), keys.begin()+100, keys.end(), std::greater<int>());
+	par_nth_element(items.begin(), items.begin()+100, items.end(), 4, std::greater<int>(), key);
+	EXPECT_EQ(keys[100], items[100].key);
+}
+
+TEST(NthElement, ParSelectScaling) {
+	// odd size, so the median rank of percentiles() is sz/2
+	const size_t sz = (1<<25)+1;
+	std::vector<int> data(sz);
+	for (auto &d:data)
+		d = std::rand();
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	std::vector<int> seq(data);
+	start = std::chrono::system_clock::now();
+	my_nth_element(seq.begin(), seq.begin()+sz/2, seq.end());
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> single = end-start;
+	std::cerr << "[          ] n=" << sz << " my_nth_element = " << single.count() << std::endl;
+	std::vector<int> nthreads{1, 2, 4};
+	int hw = std::thread::hardware_concurrency();
+	if (hw > 4)
+		nthreads.push_back(hw);
+	for (int nt:nthreads) {
+		ParSelect<std::vector<int>::iterator> sel(nt);
+		std::vector<int> work(data);
+		start = std::chrono::system_clock::now();
+		sel.partition3way(work.begin(), work.end());
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> part = end-start;
+		work = data;
+		start = std::chrono::system_clock::now();
+		sel.nth_element(work.begin(), work.begin()+sz/2, work.end());
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> nth = end-start;
+		EXPECT_EQ(seq[sz/2], work[sz/2]);
+		work = data;
+		std::vector<int> pc;
+		start = std::chrono::system_clock::now();
+		sel.percentiles(work.begin(), work.end(), {0.5, 0.9, 0.99}, pc);
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> perc = end-start;
+		EXPECT_EQ(seq[sz/2], pc[0]);
+		std::cerr << "[          ] threads=" << nt << " partition3way = " << part.count() << " nth_element = " << nth.count()
+			<< " p50/p90/p99 = " << perc.count() << std::endl;
+	}
+}
@@ -0,0 +1,143 @@
+#include <sstream>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include "gtest/gtest.h"
+#include "par.hpp"
+
+/**
+ * Built with YALG_PAR_STATS, see par.hpp
+ */
+
+class SleepySlices: public ParallelExec {
+protected:
+	virtual void exec_slice(int n) override {
+		std::this_thread::sleep_for(std::chrono::milliseconds(n+1));
+	}
+public:
+	SleepySlices(int nthreads):ParallelExec(nthreads) {
+	}
+	void go() {
+		exec();
+	}
+};
+
+static uint64_t hist_total(const ParStats &st) {
+	uint64_t cnt = 0;
+	for (int i=0; i<ParStats::buckets; i++)
+		cnt += st.hist[i];
+	return cnt;
+}
+
+TEST(ParStatsTest, ParallelExec) {
+	SleepySlices ss(3);
+	for (int i=0; i<5; i++)
+		ss.go();
+	for (int n=0; n<3; n++) {
+		const ParStats &st = ss.slice_stats(n);
+		EXPECT_EQ(5U, st.items);
+		EXPECT_EQ(5U, hist_total(st));
+		EXPECT_GE(st.busy_ns, 5*(n+1)*1000000ULL);
+		// every call lands into [2^b, 2^(b+1)) bucket, which covers n+1 ms
+		int b = 0;
+		while ((1ULL<<(b+1)) <= (n+1)*1000000ULL)
+			b++;
+		uint64_t slow = 0;
+		for (int i=b; i<ParStats::buckets; i++)
+			slow += st.hist[i];
+		EXPECT_EQ(5U, slow);
+	}
+	// faster slices sit idle waiting for the slowest one
+	EXPECT_GT(ss.slice_stats(0).wait_parent_ns, 0U);
+}
+
+class CountHead: public PipeHeadExec {
+	int limit;
+	int el[2];
+	virtual void *next() override {
+		if (batch < limit) {
+			el[batch%2] = batch;
+			return &el[batch%2];
+		} else {
+			return nullptr;
+		}
+	}
+public:
+	CountHead(int limit):PipeHeadExec(),limit(limit) {
+	}
+};
+
+class SlowStage: public PipeStageExec {
+	int el[2];
+	virtual void *next(void *arg) override {
+		std::this_thread::sleep_for(std::chrono::microseconds(500));
+		el[batch%2] = *(int*)arg;
+		return &el[batch%2];
+	}
+public:
+	using PipeStageExec::PipeStageExec;
+};
+
+class FastStage: public PipeStageExec {
+	int el[2];
+	virtual void *next(void *arg) override {
+		el[batch%2] = *(int*)arg;
+		return &el[batch%2];
+	}
+public:
+	using PipeStageExec::PipeStageExec;
+};
+
+TEST(ParStatsTest, Conveyor) {
+	constexpr int n = 50;
+	CountHead head(n);
+	SlowStage slow(head);
+	FastStage fast(slow);
+	int cnt = 0;
+	for (auto pel:PipeOutput(fast)) {
+		(void)pel;
+		cnt++;
+	}
+	EXPECT_EQ(n, cnt);
+	EXPECT_EQ(uint64_t(n), head.pipe_stats().items);
+	EXPECT_EQ(uint64_t(n), slow.pipe_stats().items);
+	EXPECT_EQ(uint64_t(n), fast.pipe_stats().items);
+	// slow stage is the bottleneck, its neighbours wait on it
+	EXPECT_GE(slow.pipe_stats().busy_ns, n*500000ULL);
+	EXPECT_GT(head.pipe_stats().wait_child_ns, slow.pipe_stats().wait_child_ns);
+	EXPECT_GT(fast.pipe_stats().wait_parent_ns, slow.pipe_stats().wait_parent_ns);
+	EXPECT_GT(slow.pipe_stats().busy_ns, fast.pipe_stats().busy_ns);
+}
+
+TEST(ParStatsTest, ChromeTrace) {
+	ParTrace::start();
+	{
+		SleepySlices ss(2);
+		ss.go();
+		CountHead head(3);
+		FastStage fast(head);
+		for (auto pel:PipeOutput(fast))
+			(void)pel;
+	}
+	ParTrace::stop();
+	std::ostringstream os;
+	ParTrace::dump(os);
+	std::string json = os.str();
+	EXPECT_EQ(0U, json.find("{\"traceEvents\":["));
+	EXPECT_NE(std::string::npos, json.find("SleepySlices slice 1"));
+	EXPECT_NE(std::string::npos, json.find("CountHead"));
+	EXPECT_NE(std::string::npos, json.find("FastStage"));
+	// 2 slices + 3 head items + 3 stage items
+	size_t events = 0;
+	for (size_t p=0; (p=json.find("\"ph\":\"X\"", p)) != std::string::npos; p++)
+		events++;
+	EXPECT_EQ(8U, events);
+	// nothing is collected once stopped
+	{
+		SleepySlices ss(2);
+		ss.go();
+	}
+	std::ostringstream os2;
+	ParTrace::dump(os2);
+	EXPECT_EQ(json, os2.str());
+}
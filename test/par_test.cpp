@@ -1,6 +1,16 @@
 #include <memory>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <cstring>
+#include <atomic>
+#include <stdexcept>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "gtest/gtest.h"
 #include "par.hpp"
+#include "pipe.hpp"
 
 /**
  * Usage example
@@ -105,6 +115,246 @@ TEST(ParTest, Idle) {
 	EXPECT_TRUE("creation and teardown without execution");
 }
 
+// batch mode, each element keeps 2*chunk copies of results
+class ChunkGenStage: public PipeHeadExec {
+private:
+	int limit;
+	std::vector<PIPE_ELEMENT> el;
+	virtual void *next() override {
+		if (batch < limit) {
+			PIPE_ELEMENT &e = el[batch%el.size()];
+			e = PIPE_ELEMENT {batch, -1, nullptr};
+			return &e;
+		} else {
+			return nullptr;
+		}
+	}
+public:
+	ChunkGenStage(int limit, int chunk):PipeHeadExec(chunk),limit(limit),el(2*chunk) {
+	}
+};
+
+class ChunkCategorizeStage: public PipeStageExec {
+private:
+	std::vector<PIPE_ELEMENT> el;
+	virtual void *next(void *arg) override {
+		PIPE_ELEMENT &e = el[batch%el.size()];
+		e = *(PIPE_ELEMENT*)arg;
+		e.category = e.num&1;
+		return &e;
+	}
+public:
+	ChunkCategorizeStage(PipeHeadExec &parent):PipeStageExec(parent),el(2*chunk) {
+	}
+};
+
+class ChunkLabelStage: public PipeStageExec {
+private:
+	const char *label[2] {"even", "odd"};
+	std::vector<PIPE_ELEMENT> el;
+	virtual void *next(void *arg) override {
+		PIPE_ELEMENT &e = el[batch%el.size()];
+		e = *(PIPE_ELEMENT*)arg;
+		e.label = label[e.category];
+		return &e;
+	}
+public:
+	ChunkLabelStage(PipeHeadExec &parent):PipeStageExec(parent),el(2*chunk) {
+	}
+};
+
+TEST(ParTest, ChunkedVolume) {
+	constexpr int64_t n = 10007;
+	for (int chunk:{1, 2, 3, 16, 64, 20000}) {
+		ChunkGenStage generate(n, chunk);
+		ChunkCategorizeStage categorize(generate);
+		ChunkLabelStage label(categorize);
+		int64_t cnt = 0;
+		for (auto pel:PipeOutput(label)) {
+			PIPE_ELEMENT *el = (PIPE_ELEMENT*)pel;
+			EXPECT_EQ(cnt, el->num);
+			EXPECT_EQ(el->num&1, el->category);
+			EXPECT_STREQ(el->num&1 ? "odd" : "even", el->label);
+			cnt++;
+		}
+		EXPECT_EQ(n, cnt);
+	}
+}
+
+TEST(ParTest, ChunkedIdle) {
+	{
+		ChunkGenStage generate(1000, 16);
+		ChunkCategorizeStage categorize(generate);
+	}
+	EXPECT_TRUE("creation and teardown without execution");
+}
+
+TEST(ParTest, ChunkedThroughput) {
+	constexpr int64_t n = 50000;
+	for (int chunk:{1, 16, 256}) {
+		std::chrono::time_point<std::chrono::system_clock> start, end;
+		start = std::chrono::system_clock::now();
+		ChunkGenStage generate(n, chunk);
+		ChunkCategorizeStage categorize(generate);
+		ChunkLabelStage label(categorize);
+		int64_t cnt = 0;
+		for (auto pel:PipeOutput(label)) {
+			(void)pel;
+			cnt++;
+		}
+		end = std::chrono::system_clock::now();
+		EXPECT_EQ(n, cnt);
+		std::chrono::duration<double> d = end-start;
+		std::cerr << "[          ] chunk=" << chunk << " " << n/d.count() << " items/sec" << std::endl;
+	}
+}
+
+template<class F> static double seconds(F f) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	f();
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> d = end-start;
+	return d.count();
+}
+
+// endless source, stops only by cancellation
+class EndlessGenStage: public PipeHeadExec {
+private:
+	std::vector<PIPE_ELEMENT> el;
+	virtual void *next() override {
+		PIPE_ELEMENT &e = el[batch%el.size()];
+		e = PIPE_ELEMENT {batch, -1, nullptr};
+		return &e;
+	}
+public:
+	EndlessGenStage(int chunk, const PipeCancelToken &token = PipeCancelToken()):PipeHeadExec(chunk, token),el(2*chunk) {
+	}
+};
+
+// throws on the given item
+class FailingStage: public PipeStageExec {
+private:
+	int fail_on;
+	virtual void *next(void *arg) override {
+		if (((PIPE_ELEMENT*)arg)->num == fail_on)
+			throw std::runtime_error("stage failure");
+		return arg;
+	}
+public:
+	FailingStage(PipeHeadExec &parent, int fail_on):PipeStageExec(parent),fail_on(fail_on) {
+	}
+};
+
+class FailingGenStage: public PipeHeadExec {
+private:
+	int fail_on;
+	std::vector<PIPE_ELEMENT> el;
+	virtual void *next() override {
+		if (batch == fail_on)
+			throw std::runtime_error("head failure");
+		PIPE_ELEMENT &e = el[batch%el.size()];
+		e = PIPE_ELEMENT {batch, -1, nullptr};
+		return &e;
+	}
+public:
+	FailingGenStage(int chunk, int fail_on):PipeHeadExec(chunk),fail_on(fail_on),el(2*chunk) {
+	}
+};
+
+// nullptr is a valid result for odd items
+class NullOddStage: public PipeStageExec {
+private:
+	virtual void *next(void *arg) override {
+		return (((PIPE_ELEMENT*)arg)->num&1) ? nullptr : arg;
+	}
+public:
+	using PipeStageExec::PipeStageExec;
+};
+
+TEST(ParTest, StageException) {
+	for (int chunk:{1, 16}) {
+		ChunkGenStage generate(1000, chunk);
+		FailingStage fail(generate, 500);
+		ChunkCategorizeStage categorize(fail);
+		ChunkLabelStage label(categorize);
+		int cnt = 0;
+		EXPECT_THROW({
+			for (auto pel:PipeOutput(label)) {
+				(void)pel;
+				cnt++;
+			}
+		}, std::runtime_error);
+		EXPECT_LE(cnt, 500);
+	}
+}
+
+TEST(ParTest, HeadException) {
+	for (int chunk:{1, 16}) {
+		FailingGenStage generate(chunk, 300);
+		ChunkCategorizeStage categorize(generate);
+		ChunkLabelStage label(categorize);
+		int cnt = 0;
+		try {
+			for (auto pel:PipeOutput(label)) {
+				(void)pel;
+				cnt++;
+			}
+			FAIL() << "exception expected";
+		} catch (const std::runtime_error &e) {
+			EXPECT_STREQ("head failure", e.what());
+		}
+		EXPECT_LE(cnt, 300);
+	}
+}
+
+TEST(ParTest, CancelToken) {
+	PipeCancelToken token;
+	EndlessGenStage generate(4, token);
+	ChunkCategorizeStage categorize(generate);
+	ChunkLabelStage label(categorize);
+	int cnt = 0;
+	for (auto pel:PipeOutput(label)) {
+		EXPECT_EQ(cnt, ((PIPE_ELEMENT*)pel)->num);
+		if (++cnt == 1000)
+			token.cancel();
+	}
+	EXPECT_EQ(1000, cnt);
+	EXPECT_TRUE(label.token().cancelled());
+}
+
+TEST(ParTest, EarlyBreak) {
+	auto t = seconds([] {
+		EndlessGenStage generate(256);
+		ChunkCategorizeStage categorize(generate);
+		ChunkLabelStage label(categorize);
+		int cnt = 0;
+		for (auto pel:PipeOutput(label)) {
+			(void)pel;
+			if (++cnt == 10)
+				break;
+		}
+		EXPECT_EQ(10, cnt);
+	});
+	EXPECT_LT(t, 1.0);	// abandoned conveyor stops right away
+}
+
+TEST(ParTest, NullResult) {
+	constexpr int n = 1001;
+	for (int chunk:{1, 16}) {
+		ChunkGenStage generate(n, chunk);
+		NullOddStage filter(generate);
+		int cnt = 0, nulls = 0;
+		for (auto pel:PipeOutput(filter)) {
+			if (pel == nullptr)
+				nulls++;
+			cnt++;
+		}
+		EXPECT_EQ(n, cnt);
+		EXPECT_EQ(n/2, nulls);
+	}
+}
+
 // produce 100 batches of 1M elements each
 class GenValues: public ParallelExec, public PipeHeadExec {
 protected:
@@ -217,3 +467,409 @@ TEST(ParTest, ParallelConveyor) {
 	}
 	EXPECT_TRUE(limit*sz*(limit*sz-1)/2 == sum);
 }
+
+// every slice records where it ran and touches its own block first
+class PinnedFill: public ParallelExec {
+public:
+	std::unique_ptr<int[]> buf;
+	size_t sz;
+	std::vector<int> ran_on;
+	PinnedFill(int nthreads, const ParAffinity &aff, size_t sz):ParallelExec(nthreads, aff),buf(new int[sz]),sz(sz),ran_on(nthreads, -1) {
+	}
+	void fill() {
+		exec();
+	}
+	int cpu(int n) const {
+		return slice_cpu(n);
+	}
+	int node(int n) const {
+		return slice_node(n);
+	}
+protected:
+	virtual void exec_slice(int n) override {
+#ifdef __linux__
+		ran_on[n] = sched_getcpu();
+#endif
+		first_touch(n, buf.get(), sz, n);
+	}
+};
+
+TEST(ParTest, AffinityPolicies) {
+	constexpr size_t sz = 1000003;
+	for (auto policy:{ParAffinity::NONE, ParAffinity::COMPACT, ParAffinity::SCATTER}) {
+		PinnedFill pf(5, ParAffinity(policy), sz);
+		pf.fill();
+		for (int n=0; n<5; n++) {
+			if (policy == ParAffinity::NONE) {
+				EXPECT_EQ(-1, pf.cpu(n));
+				EXPECT_EQ(-1, pf.node(n));
+			} else if (pf.cpu(n) >= 0) {
+#ifdef __linux__
+				EXPECT_EQ(pf.cpu(n), pf.ran_on[n]);
+#endif
+				EXPECT_GE(pf.node(n), 0);
+			}
+		}
+		// every block is filled by its own slice
+		size_t blocksz = (sz+4)/5;
+		for (size_t i=0; i<sz; i++)
+			ASSERT_EQ(int(i/blocksz), pf.buf[i]);
+	}
+}
+
+TEST(ParTest, AffinityList) {
+	PinnedFill pf(3, ParAffinity(std::vector<int>{0}), 10);
+	pf.fill();
+	for (int n=0; n<3; n++) {
+		if (pf.cpu(n) >= 0) {
+			EXPECT_EQ(0, pf.cpu(n));
+#ifdef __linux__
+			EXPECT_EQ(0, pf.ran_on[n]);
+#endif
+		}
+	}
+	// unknown cpu leaves the thread unpinned
+	PinnedFill bad(2, ParAffinity(std::vector<int>{1<<20}), 10);
+	bad.fill();
+	EXPECT_EQ(-1, bad.cpu(0));
+	EXPECT_EQ(-1, bad.cpu(1));
+}
+
+/**
+ * Typed conveyor, see pipe.hpp
+ */
+
+class TGenStage: public PipeHead<PIPE_ELEMENT> {
+private:
+	int limit;
+	int batch;
+	virtual bool next(PIPE_ELEMENT &el) override {
+		if (batch < limit) {
+			el = PIPE_ELEMENT {batch++, -1, nullptr};
+			return true;
+		} else {
+			return false;
+		}
+	}
+public:
+	TGenStage(int limit, size_t depth = 16):PipeHead(depth),limit(limit),batch(0) {
+	}
+};
+
+class TCategorizeStage: public PipeStage<PIPE_ELEMENT, PIPE_ELEMENT> {
+private:
+	virtual PIPE_ELEMENT next(PIPE_ELEMENT &&el) override {
+		el.category = el.num&1;
+		return el;
+	}
+public:
+	using PipeStage::PipeStage;
+};
+
+class TLabelStage: public PipeStage<PIPE_ELEMENT, PIPE_ELEMENT> {
+private:
+	const char *label[2] {"even", "odd"};
+	virtual PIPE_ELEMENT next(PIPE_ELEMENT &&el) override {
+		el.label = label[el.category];
+		return el;
+	}
+public:
+	using PipeStage::PipeStage;
+};
+
+TEST(ParTest, TypedSimple) {
+	constexpr int64_t n = 10000;
+	TGenStage generate(n);
+	TCategorizeStage categorize(generate);
+	TLabelStage label(categorize);
+	int64_t cnt = 0;
+	int64_t num_sum = 0;
+	int64_t cat_sum = 0;
+	for (auto &el:PipeSink<PIPE_ELEMENT>(label)) {
+		EXPECT_EQ(cnt, el.num);	// order is preserved
+		num_sum += el.num;
+		cat_sum += el.category;
+		if (el.num&1)
+			EXPECT_TRUE(el.category == 1 && !strcmp(el.label, "odd"));
+		else
+			EXPECT_TRUE(el.category == 0 && !strcmp(el.label, "even"));
+		cnt++;
+	}
+	EXPECT_EQ(n, cnt);
+	EXPECT_TRUE(num_sum == n*(n-1)/2 && cat_sum == n/2);
+}
+
+TEST(ParTest, TypedEmpty) {
+	TGenStage generate(0);
+	TCategorizeStage categorize(generate);
+	int cnt = 0;
+	for (auto &el:PipeSink<PIPE_ELEMENT>(categorize)) {
+		(void)el;
+		cnt++;
+	}
+	EXPECT_EQ(0, cnt);
+}
+
+TEST(ParTest, TypedIdle) {
+	{
+		TGenStage generate(1000000, 4);
+		TCategorizeStage categorize(generate, 4);
+		TLabelStage label(categorize, 4);
+	}
+	EXPECT_TRUE("creation and teardown without consuming");
+}
+
+TEST(ParTest, TypedEarlyExit) {
+	TGenStage generate(std::numeric_limits<int>::max());
+	TCategorizeStage categorize(generate);
+	int cnt = 0;
+	for (auto &el:PipeSink<PIPE_ELEMENT>(categorize)) {
+		EXPECT_EQ(cnt, el.num);
+		if (++cnt == 100)
+			break;
+	}
+	EXPECT_EQ(100, cnt);
+}
+
+// same as GenValues/AddValues/Accumulate, but buffers are moved through the queues
+struct TBUF {
+	std::unique_ptr<int[]> n;
+	int sz;
+};
+
+class TGenValues: public ParallelExec, public PipeHead<TBUF> {
+protected:
+	int limit;
+	int sz;
+	int batch;
+	TBUF *r;
+	virtual void exec_slice(int n) override {
+		int blocksz = (sz+nthreads-1)/nthreads;
+		int upto = std::min(blocksz*(n+1), sz);
+		for (int i=blocksz*n; i<upto; i++)
+			r->n[i] = batch*sz+i;
+	}
+	virtual bool next(TBUF &res) override {
+		if (batch < limit) {
+			res = TBUF { std::unique_ptr<int[]>(new int[sz]), sz };
+			r = &res;
+			exec();
+			batch++;
+			return true;
+		} else {
+			return false;
+		}
+	}
+public:
+	TGenValues(int limit, int sz, int nthreads):ParallelExec(nthreads),PipeHead(),limit(limit),sz(sz),batch(0) {
+	}
+};
+
+class TAddValues: public ParallelExec, public PipeStage<TBUF, TBUF> {
+protected:
+	int inc;
+	TBUF *r;
+	virtual void exec_slice(int n) override {
+		int blocksz = (r->sz+nthreads-1)/nthreads;
+		int upto = std::min(blocksz*(n+1),r->sz);
+		for (int i=blocksz*n; i<upto; i++)
+			r->n[i] += inc;
+	}
+	virtual TBUF next(TBUF &&arg) override {
+		r = &arg;
+		exec();
+		return std::move(arg);
+	}
+public:
+	TAddValues(int inc, int nthreads, PipeHead<TBUF> &parent):ParallelExec(nthreads),PipeStage(parent),inc(inc) {
+	}
+};
+
+class TAccumulate: public ParallelExec, public PipeStage<TBUF, int64_t> {
+protected:
+	static constexpr int nth = 4;
+	int64_t sum[nth];
+	TBUF *r;
+	virtual void exec_slice(int n) override {
+		int blocksz = (r->sz+nthreads-1)/nthreads;
+		int upto = std::min(blocksz*(n+1),r->sz);
+		for (int i=blocksz*n; i<upto; i++)
+			sum[n] += r->n[i];
+	}
+	virtual int64_t next(TBUF &&arg) override {
+		r = &arg;
+		for (int j=0; j<nthreads; j++)
+			sum[j] = 0;
+		exec();
+		int64_t s = 0;
+		for (int j=0; j<nthreads; j++)
+			s += sum[j];
+		return s;
+	}
+public:
+	TAccumulate(PipeHead<TBUF> &parent):ParallelExec(nth),PipeStage(parent) {
+	}
+};
+
+TEST(ParTest, TypedParallelConveyor) {
+	int64_t limit = 100;
+	int64_t sz = 1000013;
+	TGenValues gen(limit, sz, 7);
+	TAddValues add_one(1, 3, gen);
+	TAddValues add_minus_one(-1, 5, add_one);
+	TAccumulate acc(add_minus_one);
+	int64_t sum = 0;
+	for (auto s:PipeSink<int64_t>(acc))
+		sum += s;
+	EXPECT_TRUE(limit*sz*(limit*sz-1)/2 == sum);
+}
+
+
+TEST(ParTest, TypedConveyorPerformance) {
+	// the same workload as in ParallelConveyor
+	int64_t limit = 100;
+	int64_t sz = 1000013;
+	int64_t expected = limit*sz*(limit*sz-1)/2;
+	double lockstep = seconds([&]{
+		GenValues gen(limit, sz, 7);
+		AddValues add_one(1, 3, gen);
+		AddValues add_minus_one(-1, 5, add_one);
+		Accumulate acc(add_minus_one);
+		int64_t sum = 0;
+		for (auto pel:PipeOutput(acc)) {
+			Accumulate::TSUM *el = (Accumulate::TSUM*)pel;
+			for (int i=0; i<acc.nth; i++)
+				sum += el->sum[i];
+		}
+		EXPECT_EQ(expected, sum);
+	});
+	double typed = seconds([&]{
+		TGenValues gen(limit, sz, 7);
+		TAddValues add_one(1, 3, gen);
+		TAddValues add_minus_one(-1, 5, add_one);
+		TAccumulate acc(add_minus_one);
+		int64_t sum = 0;
+		for (auto s:PipeSink<int64_t>(acc))
+			sum += s;
+		EXPECT_EQ(expected, sum);
+	});
+	std::cerr << "[          ] lock-step conveyor " << limit/lockstep << " batches/sec" << std::endl;
+	std::cerr << "[          ] typed conveyor     " << limit/typed << " batches/sec" << std::endl;
+}
+
+TEST(ParTest, TypedThroughput) {
+	// small elements, synchronization cost dominates
+	constexpr int64_t n = 50000;
+	double lockstep = seconds([&]{
+		GenStage generate(n);
+		CategorizeStage categorize(generate);
+		LabelStage label(categorize);
+		int64_t cnt = 0;
+		for (auto pel:PipeOutput(label)) {
+			(void)pel;
+			cnt++;
+		}
+		EXPECT_EQ(n, cnt);
+	});
+	std::cerr << "[          ] lock-step conveyor " << n/lockstep << " items/sec" << std::endl;
+	for (size_t depth:{1, 16, 256}) {
+		double typed = seconds([&]{
+			TGenStage generate(n, depth);
+			TCategorizeStage categorize(generate, depth);
+			TLabelStage label(categorize, depth);
+			int64_t cnt = 0;
+			for (auto &el:PipeSink<PIPE_ELEMENT>(label)) {
+				(void)el;
+				cnt++;
+			}
+			EXPECT_EQ(n, cnt);
+		});
+		std::cerr << "[          ] typed conveyor depth=" << depth << " " << n/typed << " items/sec" << std::endl;
+	}
+}
+
+// slow reentrant stage, burns cpu proportionally to work
+class TBusyStage: public PipeStage<PIPE_ELEMENT, PIPE_ELEMENT> {
+private:
+	int work;
+	std::atomic<uint64_t> noise;	// keeps the busy loop from being optimized out
+	virtual PIPE_ELEMENT next(PIPE_ELEMENT &&el) override {
+		uint64_t h = el.num;
+		for (int i=0; i<work; i++)
+			h = h*6364136223846793005ULL+1442695040888963407ULL;
+		noise.fetch_add(h, std::memory_order_relaxed);
+		el.category = el.num&1;
+		return el;
+	}
+public:
+	TBusyStage(PipeHead<PIPE_ELEMENT> &parent, int work, int replicas, bool ordered):PipeStage(parent, 16, replicas, ordered),work(work),noise(0) {
+	}
+};
+
+TEST(ParTest, TypedReplicasOrdered) {
+	constexpr int64_t n = 10007;
+	TGenStage generate(n);
+	TBusyStage busy(generate, 10, 3, true);
+	TLabelStage label(busy, 16, 2, true);
+	TCategorizeStage categorize(label, 4);
+	int64_t cnt = 0;
+	for (auto &el:PipeSink<PIPE_ELEMENT>(categorize)) {
+		EXPECT_EQ(cnt, el.num);
+		EXPECT_STREQ(el.num&1 ? "odd" : "even", el.label);
+		cnt++;
+	}
+	EXPECT_EQ(n, cnt);
+}
+
+TEST(ParTest, TypedReplicasRelaxed) {
+	constexpr int64_t n = 10007;
+	TGenStage generate(n);
+	TBusyStage busy(generate, 10, 4, false);
+	TLabelStage label(busy, 16, 3, true);	// ordered after relaxed is still relaxed
+	int64_t cnt = 0;
+	int64_t num_sum = 0;
+	for (auto &el:PipeSink<PIPE_ELEMENT>(label)) {
+		EXPECT_STREQ(el.num&1 ? "odd" : "even", el.label);
+		num_sum += el.num;
+		cnt++;
+	}
+	EXPECT_EQ(n, cnt);
+	EXPECT_EQ(n*(n-1)/2, num_sum);
+}
+
+TEST(ParTest, TypedReplicasEarlyExit) {
+	for (bool ordered:{true, false}) {
+		TGenStage generate(std::numeric_limits<int>::max());
+		TBusyStage busy(generate, 10, 4, ordered);
+		int cnt = 0;
+		for (auto &el:PipeSink<PIPE_ELEMENT>(busy)) {
+			(void)el;
+			if (++cnt == 100)
+				break;
+		}
+		EXPECT_EQ(100, cnt);
+	}
+}
+
+TEST(ParTest, TypedReplicasScaling) {
+	// skewed pipeline: one stage is 100x slower than the others
+	constexpr int64_t n = 2000;
+	std::cerr << "[          ] hardware threads " << std::thread::hardware_concurrency() << std::endl;
+	for (bool ordered:{true, false}) {
+		for (int replicas:{1, 2, 4, 8}) {
+			double t = seconds([&]{
+				TGenStage generate(n);
+				TBusyStage light(generate, 100, 1, true);
+				TBusyStage heavy(light, 10000, replicas, ordered);
+				TLabelStage label(heavy);
+				int64_t cnt = 0;
+				for (auto &el:PipeSink<PIPE_ELEMENT>(label)) {
+					(void)el;
+					cnt++;
+				}
+				EXPECT_EQ(n, cnt);
+			});
+			std::cerr << "[          ] " << (ordered ? "ordered" : "relaxed") << " replicas=" << replicas << " " << n/t << " items/sec" << std::endl;
+		}
+	}
+}
@@ -1,5 +1,12 @@
 #include "prefix.hpp"
+#include "par_prefix.hpp"
 #include "gtest/gtest.h"
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <system_error>
+#include <stdexcept>
 
 TEST(Prefix, PrefixSimple) {
 	EXPECT_EQ(4, kmp_strstr("abracadabra", "cad"));
@@ -39,3 +46,504 @@ TEST(Prefix, PrefixRepeating) {
 	for (int i=3; i<sz; i++)
 		EXPECT_EQ(i-2, prefix[i]);
 }
+
+TEST(Prefix, PrefixZeroBytes) {
+	std::string text("ab\0cd\0ab\0cd", 11);
+	std::string key("\0cd", 3);
+	EXPECT_EQ(2, kmp_strstr(text, key));
+	EXPECT_EQ(std::string::npos, kmp_strstr(text, std::string("d\0d", 3)));
+	EXPECT_EQ(std::string::npos, kmp_strstr("abc", "abcd"));
+	EXPECT_EQ(0, kmp_strstr("abc", ""));
+	EXPECT_EQ(std::string::npos, kmp_strstr("", "a"));
+}
+
+TEST(Prefix, PrefixAllMatches) {
+	for (int t=0; t<100; t++) {
+		// small alphabet including '\0' to get many overlapping matches
+		std::string text(1000+rand()%1000, ' ');
+		for (auto &c:text)
+			c = rand()%3;
+		std::string key(1+rand()%5, ' ');
+		for (auto &c:key)
+			c = rand()%3;
+		std::vector<size_t> exp, res;
+		for (size_t p=text.find(key); p!=std::string::npos; p=text.find(key, p+1))
+			exp.push_back(p);
+		KmpPattern kmp(key);
+		EXPECT_TRUE(kmp.each(text.data(), text.data()+text.size(), [&res](size_t p) {
+			res.push_back(p);
+			return true;
+		}));
+		EXPECT_EQ(exp, res);
+		EXPECT_EQ(text.find(key), kmp.find(text.data(), text.data()+text.size()));
+		EXPECT_EQ(text.find(key), kmp_strstr(text, key));
+	}
+	// stop after the first two matches
+	std::vector<size_t> res;
+	KmpPattern aa("aa");
+	std::string text(10, 'a');
+	EXPECT_FALSE(aa.each(text.data(), text.data()+text.size(), [&res](size_t p) {
+		res.push_back(p);
+		return res.size() < 2;
+	}));
+	EXPECT_EQ(std::vector<size_t>({0, 1}), res);
+	// every position for an empty key
+	res.clear();
+	KmpPattern empty("");
+	empty.each(text.data(), text.data()+3, [&res](size_t p) {
+		res.push_back(p);
+		return true;
+	});
+	EXPECT_EQ(std::vector<size_t>({0, 1, 2, 3}), res);
+}
+
+TEST(Prefix, StreamChunks) {
+	std::string text(100000, ' ');
+	for (auto &c:text)
+		c = 'a'+rand()%2;
+	std::string key("abaab");
+	KmpPattern kmp(key);
+	std::vector<size_t> exp;
+	kmp.each(text.data(), text.data()+text.size(), [&exp](size_t p) {
+		exp.push_back(p);
+		return true;
+	});
+	ASSERT_FALSE(exp.empty());
+	for (size_t chunk:{1, 2, 3, 5, 4096}) {
+		KmpStream stream(kmp);
+		std::vector<size_t> res;
+		for (size_t p=0; p<text.size(); p+=chunk)
+			stream.feed(text.data()+p, std::min(chunk, text.size()-p), [&res](uint64_t pos) {
+				res.push_back(pos);
+				return true;
+			});
+		EXPECT_EQ(text.size(), stream.offset());
+		EXPECT_EQ(exp, res) << "chunk=" << chunk;
+	}
+	KmpPattern empty("");
+	EXPECT_THROW(KmpStream s(empty), std::invalid_argument);
+	// stopped stream resumes right after the match
+	KmpStream stream(kmp);
+	std::vector<size_t> res;
+	auto first = [&res](uint64_t pos) {
+		res.push_back(pos);
+		return false;
+	};
+	EXPECT_FALSE(stream.feed(text.data(), text.size(), first));
+	EXPECT_EQ(exp[0]+key.size(), stream.offset());
+	uint64_t off = stream.offset();
+	stream.feed(text.data()+off, text.size()-off, first);
+	EXPECT_EQ(exp[1], res[1]);
+	stream.reset();
+	EXPECT_EQ(0U, stream.offset());
+}
+
+TEST(Prefix, ScanFile) {
+	const char *path = "prefix_scan_test.tmp";
+	std::string text("one\0two\0one\0three", 17);
+	{
+		std::ofstream out(path, std::ios::binary);
+		out.write(text.data(), text.size());
+	}
+	std::vector<size_t> res;
+	EXPECT_TRUE(kmp_scan_file(path, KmpPattern(std::string("one\0", 4)), [&res](size_t p) {
+		res.push_back(p);
+		return true;
+	}));
+	EXPECT_EQ(std::vector<size_t>({0, 8}), res);
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	}
+	EXPECT_TRUE(kmp_scan_file(path, KmpPattern("one"), [](size_t) {
+		return false;
+	}));
+	std::remove(path);
+	EXPECT_THROW(kmp_scan_file(path, KmpPattern("one"), [](size_t) {
+		return true;
+	}), std::system_error);
+}
+
+TEST(Prefix, StreamPerformance) {
+	const char *path = "prefix_perf_test.tmp";
+	const size_t sz = 128*1024*1024;
+	std::string text(sz, ' ');
+	for (size_t i=0; i<sz; i++)
+		text[i] = 'a'+rand()%4;
+	std::string key("abcdabcdabcdabcd");
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	size_t cnt_all = 0, cnt_stream = 0, cnt_file = 0;
+	start = std::chrono::system_clock::now();
+	KmpPattern kmp(key);
+	kmp.each(text.data(), text.data()+sz, [&cnt_all](size_t) {
+		cnt_all++;
+		return true;
+	});
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> all = end-start;
+	start = std::chrono::system_clock::now();
+	KmpStream stream(kmp);
+	const size_t chunk = 64*1024;
+	for (size_t p=0; p<sz; p+=chunk)
+		stream.feed(text.data()+p, std::min(chunk, sz-p), [&cnt_stream](uint64_t) {
+			cnt_stream++;
+			return true;
+		});
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> chunked = end-start;
+	EXPECT_EQ(cnt_all, cnt_stream);
+	{
+		std::ofstream out(path, std::ios::binary);
+		out.write(text.data(), sz);
+	}
+	start = std::chrono::system_clock::now();
+	kmp_scan_file(path, kmp, [&cnt_file](size_t) {
+		cnt_file++;
+		return true;
+	});
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> file = end-start;
+	std::remove(path);
+	EXPECT_EQ(cnt_all, cnt_file);
+	double gb = sz/1e9;
+	std::cerr << "[          ] KMP scan of " << sz/(1024*1024) << " MB: whole buffer = " << gb/all.count()
+		<< " chunks of " << chunk/1024 << " KB = " << gb/chunked.count()
+		<< " mmap file = " << gb/file.count() << " GB/sec" << std::endl;
+}
+
+TEST(Prefix, SimdStrStr) {
+	EXPECT_EQ(4, simd_strstr("abracadabra", "cad"));
+	EXPECT_EQ(0, simd_strstr("abc", ""));
+	EXPECT_EQ(std::string::npos, simd_strstr("abc", "abcd"));
+	EXPECT_EQ(2, simd_strstr("abc", "c"));
+	EXPECT_EQ(std::string::npos, simd_strstr("abc", "d"));
+	for (int t=0; t<2000; t++) {
+		// every text length around the vector widths, '\0' included
+		std::string text(rand()%100, ' ');
+		for (auto &c:text)
+			c = rand()%3;
+		std::string key(1+rand()%8, ' ');
+		for (auto &c:key)
+			c = rand()%3;
+		if (rand()%2 && text.size() >= key.size())
+			text.replace(rand()%(text.size()-key.size()+1), key.size(), key);
+		EXPECT_EQ(text.find(key), simd_strstr(text, key)) << "text size=" << text.size() << " key size=" << key.size();
+	}
+	// periodic key runs out of the verification budget and continues with KMP
+	for (size_t sz:{1000, 4096, 100000}) {
+		std::string text(sz, 'a');
+		// first and last bytes pass the filter everywhere
+		std::string key(100, 'a');
+		key[50] = 'b';
+		EXPECT_EQ(std::string::npos, simd_strstr(text, key));
+		text.replace(sz-key.size()-7, key.size(), key);
+		EXPECT_EQ(sz-key.size()-7, simd_strstr(text, key));
+	}
+}
+
+TEST(Prefix, SimdStrStrPerformance) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	auto bench = [&](const char *name, const std::string &text, const std::string &key, int reps) {
+		size_t exp = text.find(key), res[3];
+		std::chrono::duration<double> t[3];
+		for (int m=0; m<3; m++) {
+			start = std::chrono::system_clock::now();
+			for (int r=0; r<reps; r++)
+				res[m] = m == 0 ? kmp_strstr(text, key) : m == 1 ? text.find(key) : simd_strstr(text, key);
+			end = std::chrono::system_clock::now();
+			t[m] = end-start;
+			EXPECT_EQ(exp, res[m]);
+		}
+		std::cerr << "[          ] " << name << ": kmp_strstr = " << t[0].count() << " string::find = " << t[1].count()
+			<< " simd_strstr = " << t[2].count() << " sec" << std::endl;
+	};
+	std::cerr << "[          ] simd_strstr kernel: " << simd_strstr_kernel() << std::endl;
+	// same as PrefixPerformace
+	std::string text(1024*1024, 'a');
+	text.back() = 'b';
+	std::string key(1024, 'a');
+	key.back() = 'b';
+	bench("periodic 1M text, 1K key", text, key, 10);
+	// every position passes the filter, verification budget switches to KMP
+	std::string mid(1024, 'a');
+	mid[512] = 'b';
+	text.replace(text.size()-mid.size(), mid.size(), mid);
+	bench("periodic 1M text, 1K key, 'b' in the middle", text, mid, 10);
+	std::string words(16*1024*1024, ' ');
+	for (auto &c:words)
+		c = 'a'+rand()%26;
+	for (size_t ksz:{4, 16, 64}) {
+		std::string k = words.substr(words.size()-ksz);
+		std::string name = "random 16M text, key " + std::to_string(ksz);
+		bench(name.c_str(), words, k, 5);
+	}
+}
+
+typedef std::vector<std::pair<size_t,int>> Matches;
+
+static Matches naive_matches(const std::string &text, const std::vector<std::string> &keys) {
+	Matches res;
+	for (size_t k=0; k<keys.size(); k++)
+		if (!keys[k].empty())
+			for (size_t p=text.find(keys[k]); p!=std::string::npos; p=text.find(keys[k], p+1))
+				res.push_back(std::make_pair(p, int(k)));
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+static Matches ac_matches(const AhoCorasick &ac, const std::string &text) {
+	Matches res;
+	ac.each(text.data(), text.data()+text.size(), [&res](size_t p, int k) {
+		res.push_back(std::make_pair(p, k));
+		return true;
+	});
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+TEST(Prefix, AhoCorasick) {
+	std::vector<std::string> keys{"he", "she", "his", "hers", "", "he", std::string("s\0h", 3)};
+	std::string text("ushers\0his", 10);
+	for (auto layout:{AhoCorasick::DENSE, AhoCorasick::DOUBLE_ARRAY}) {
+		AhoCorasick ac(keys, layout);
+		EXPECT_EQ(layout, ac.layout());
+		EXPECT_EQ(Matches({{1, 1}, {2, 0}, {2, 3}, {2, 5}, {5, 6}, {7, 2}}), ac_matches(ac, text));
+		int cnt = 0;
+		EXPECT_FALSE(ac.each(text.data(), text.data()+text.size(), [&cnt](size_t, int) {
+			return ++cnt < 2;
+		}));
+		EXPECT_EQ(2, cnt);
+	}
+	EXPECT_EQ(AhoCorasick::DENSE, AhoCorasick(keys).layout());
+	EXPECT_TRUE(ac_matches(AhoCorasick({}), text).empty());
+	// random keys over small and full byte alphabets
+	for (int alpha:{2, 4, 256}) {
+		for (int t=0; t<20; t++) {
+			std::vector<std::string> keys(1+rand()%50);
+			for (auto &k:keys) {
+				k.resize(1+rand()%6);
+				for (auto &c:k)
+					c = rand()%alpha;
+			}
+			std::string text(2000, ' ');
+			for (auto &c:text)
+				c = rand()%alpha;
+			Matches exp = naive_matches(text, keys);
+			EXPECT_EQ(exp, ac_matches(AhoCorasick(keys, AhoCorasick::DENSE), text)) << "alpha=" << alpha;
+			EXPECT_EQ(exp, ac_matches(AhoCorasick(keys, AhoCorasick::DOUBLE_ARRAY), text)) << "alpha=" << alpha;
+		}
+	}
+}
+
+TEST(Prefix, AhoCorasickPerformance) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	std::string text(16*1024*1024, ' ');
+	for (auto &c:text)
+		c = 'a'+rand()%26;
+	for (size_t cnt:{10, 1000, 100000}) {
+		std::vector<std::string> keys(cnt);
+		for (auto &k:keys) {
+			k.resize(4+rand()%9);
+			for (auto &c:k)
+				c = 'a'+rand()%26;
+			// plant every key into the text
+			size_t p = rand()%(text.size()-k.size());
+			text.replace(p, k.size(), k);
+		}
+		for (auto layout:{AhoCorasick::DENSE, AhoCorasick::DOUBLE_ARRAY}) {
+			start = std::chrono::system_clock::now();
+			AhoCorasick ac(keys, layout);
+			end = std::chrono::system_clock::now();
+			std::chrono::duration<double> build = end-start;
+			size_t found = 0;
+			start = std::chrono::system_clock::now();
+			ac.each(text.data(), text.data()+text.size(), [&found](size_t, int) {
+				found++;
+				return true;
+			});
+			end = std::chrono::system_clock::now();
+			std::chrono::duration<double> scan = end-start;
+			EXPECT_GE(found, cnt);
+			std::cerr << "[          ] " << cnt << " keys " << (layout == AhoCorasick::DENSE ? "dense" : "double array")
+				<< ": " << ac.states() << " states, " << ac.bytes()/1024 << " KB, build = " << build.count()
+				<< " sec, scan = " << text.size()/1e9/scan.count() << " GB/sec" << std::endl;
+		}
+		if (cnt == 10) {
+			// one KMP pass per key
+			size_t found = 0;
+			start = std::chrono::system_clock::now();
+			for (auto &k:keys)
+				KmpPattern(k).each(text.data(), text.data()+text.size(), [&found](size_t) {
+					found++;
+					return true;
+				});
+			end = std::chrono::system_clock::now();
+			std::chrono::duration<double> scan = end-start;
+			EXPECT_GE(found, cnt);
+			std::cerr << "[          ] " << cnt << " keys KmpPattern per key: scan = " << text.size()/1e9/scan.count() << " GB/sec" << std::endl;
+		}
+	}
+}
+
+TEST(Prefix, ZFunction) {
+	std::vector<int> z;
+	std::string s("aabxaab");
+	z_function(s.data(), s.data()+s.size(), z);
+	EXPECT_EQ(std::vector<int>({7, 1, 0, 0, 3, 1, 0}), z);
+	z_function(s.data(), s.data(), z);
+	EXPECT_TRUE(z.empty());
+	for (int t=0; t<100; t++) {
+		std::string text(rand()%300, ' ');
+		for (auto &c:text)
+			c = rand()%3;
+		z_function(text.data(), text.data()+text.size(), z);
+		for (size_t i=0; i<text.size(); i++) {
+			size_t k = 0;
+			while (i+k < text.size() && text[k] == text[i+k])
+				k++;
+			ASSERT_EQ(int(k), z[i]) << "i=" << i;
+		}
+	}
+}
+
+TEST(Prefix, SuffixArray) {
+	std::string banana("banana");
+	EXPECT_EQ(std::vector<int>({5, 3, 1, 0, 4, 2}), suffix_array(banana.data(), banana.data()+banana.size()));
+	EXPECT_EQ(std::vector<int>({0, 1, 3, 0, 0, 2}), lcp_array(banana.data(), banana.data()+banana.size(),
+		suffix_array(banana.data(), banana.data()+banana.size())));
+	EXPECT_TRUE(suffix_array(banana.data(), banana.data()).empty());
+	for (int alpha:{1, 2, 4, 256}) {
+		for (int t=0; t<50; t++) {
+			// bytes above 127 order after the others
+			std::string text(rand()%500, ' ');
+			for (auto &c:text)
+				c = alpha == 256 ? rand()%256 : 'a'+rand()%alpha;
+			const char *b = text.data(), *e = b+text.size();
+			std::vector<int> exp(text.size());
+			for (size_t i=0; i<exp.size(); i++)
+				exp[i] = i;
+			std::sort(exp.begin(), exp.end(), [&](int x, int y) {
+				return text.compare(x, std::string::npos, text, y, std::string::npos) < 0;
+			});
+			std::vector<int> sa = suffix_array(b, e);
+			ASSERT_EQ(exp, sa) << "alpha=" << alpha;
+			std::vector<int> lcp = lcp_array(b, e, sa);
+			for (size_t i=1; i<sa.size(); i++) {
+				int k = 0;
+				while (sa[i-1]+k < int(text.size()) && sa[i]+k < int(text.size()) && text[sa[i-1]+k] == text[sa[i]+k])
+					k++;
+				ASSERT_EQ(k, lcp[i]) << "i=" << i;
+			}
+			if (text.empty())
+				continue;
+			SuffixIndex idx(b, e);
+			EXPECT_EQ(sa, idx.suffixes());
+			for (int q=0; q<100; q++) {
+				int i = rand()%text.size(), j = rand()%text.size();
+				int k = 0;
+				while (i+k < int(text.size()) && j+k < int(text.size()) && text[i+k] == text[j+k])
+					k++;
+				ASSERT_EQ(k, idx.lcp(i, j)) << "i=" << i << " j=" << j;
+				EXPECT_EQ(i, sa[idx.rank_of(i)]);
+			}
+		}
+	}
+}
+
+TEST(Prefix, SuffixArrayPerformance) {
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	const size_t sz = 100*1024*1024;
+	// 4-letter alphabet with repeats, like genomic data
+	std::string text(sz, ' ');
+	for (size_t i=0; i<sz; i++)
+		text[i] = i >= 1024 && rand()%4 == 0 ? text[i-1000] : "acgt"[rand()%4];
+	const char *b = text.data(), *e = b+sz;
+	std::vector<int> z;
+	start = std::chrono::system_clock::now();
+	z_function(b, e, z);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> zt = end-start;
+	z = std::vector<int>();
+	start = std::chrono::system_clock::now();
+	std::vector<int> sa = suffix_array(b, e);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> sat = end-start;
+	start = std::chrono::system_clock::now();
+	std::vector<int> lcp = lcp_array(b, e, sa);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> lcpt = end-start;
+	for (size_t i=1; i<sz; i+=sz/1000)
+		ASSERT_LT(text.compare(sa[i-1], std::string::npos, text, sa[i], std::string::npos), 0);
+	sa = lcp = std::vector<int>();
+	// sparse table takes log2(N) arrays, build it on a smaller input
+	const size_t idx_sz = 8*1024*1024;
+	start = std::chrono::system_clock::now();
+	SuffixIndex idx(b, b+idx_sz);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> idxt = end-start;
+	long sum = 0;
+	start = std::chrono::system_clock::now();
+	for (int q=0; q<1000000; q++)
+		sum += idx.lcp(rand()%idx_sz, rand()%idx_sz);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> qt = end-start;
+	EXPECT_GT(sum, 0);
+	std::cerr << "[          ] " << sz/(1024*1024) << " MB: z_function = " << zt.count() << " suffix_array = " << sat.count()
+		<< " lcp_array = " << lcpt.count() << " sec" << std::endl;
+	std::cerr << "[          ] " << idx_sz/(1024*1024) << " MB SuffixIndex build = " << idxt.count()
+		<< " sec, 1M lcp queries = " << qt.count() << " sec" << std::endl;
+}
+
+TEST(Prefix, ParKmp) {
+	std::string text(100000, ' ');
+	for (auto &c:text)
+		c = 'a'+rand()%2;
+	for (const char *key:{"", "a", "abab", "aaaaaaaa", "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"}) {
+		KmpPattern kmp(key);
+		for (size_t sz:{0, 3, 1000, 100000}) {
+			std::vector<size_t> exp;
+			kmp.each(text.data(), text.data()+sz, [&exp](size_t p) {
+				exp.push_back(p);
+				return true;
+			});
+			for (int nthreads:{1, 2, 3, 7, 16}) {
+				ParKmp par(nthreads);
+				std::vector<size_t> res;
+				par.find_all(kmp, text.data(), text.data()+sz, res);
+				EXPECT_EQ(exp, res) << "key=" << key << " size=" << sz << " nthreads=" << nthreads;
+			}
+		}
+	}
+}
+
+TEST(Prefix, ParKmpScaling) {
+	const size_t sz = 128*1024*1024;
+	std::string text(sz, ' ');
+	for (size_t i=0; i<sz; i++)
+		text[i] = 'a'+rand()%4;
+	KmpPattern kmp("abcaab");
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	size_t exp = 0;
+	start = std::chrono::system_clock::now();
+	kmp.each(text.data(), text.data()+sz, [&exp](size_t) {
+		exp++;
+		return true;
+	});
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> single = end-start;
+	std::cerr << "[          ] KmpPattern::each " << sz/(1024*1024) << " MB = " << sz/1e9/single.count() << " GB/sec" << std::endl;
+	std::vector<int> nthreads{1, 2, 4};
+	int hw = std::thread::hardware_concurrency();
+	if (hw > 4)
+		nthreads.push_back(hw);
+	for (int nt:nthreads) {
+		ParKmp par(nt);
+		std::vector<size_t> res;
+		start = std::chrono::system_clock::now();
+		par.find_all(kmp, text.data(), text.data()+sz, res);
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> t = end-start;
+		EXPECT_EQ(exp, res.size());
+		std::cerr << "[          ] ParKmp " << nt << " threads = " << sz/1e9/t.count() << " GB/sec, speedup "
+			<< single.count()/t.count() << std::endl;
+	}
+}
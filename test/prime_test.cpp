@@ -1,6 +1,10 @@
 #include "prime.hpp"
+#include "par_prime.hpp"
 #include "gtest/gtest.h"
 #include <numeric>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
 
 #define dim(X)	(sizeof(X)/sizeof(X[0]))
 
@@ -118,3 +122,446 @@ TEST(Prime, SieveCheck1000) {
 			EXPECT_TRUE(*fnd > i);
 	}
 }
+
+TEST(Prime, SegmentedSieve) {
+	constexpr int n = 3000000;
+	auto seave = prime_sieve(n);
+	for (uint64_t lo:{0, 1, 2, 6, 7, 29, 30, 31, 1000, 999983, 2000001}) {
+		for (uint64_t hi:{lo, lo+1, lo+2, lo+29, lo+100, lo+983040, uint64_t(n)}) {
+			if (hi < lo)
+				continue;
+			std::vector<uint64_t> got, exp;
+			prime_sieve_each(lo, hi, [&](uint64_t p) { got.push_back(p); });
+			for (uint64_t i=lo; i<hi; i++)
+				if (seave[i])
+					exp.push_back(i);
+			EXPECT_EQ(exp, got) << "lo=" << lo << " hi=" << hi;
+		}
+	}
+}
+
+TEST(Prime, SegmentedSieveLarge) {
+	// sieve the window near 1e12 naively with primes up to 1e6
+	constexpr uint64_t lo = 1000000000000ULL-1000000, hi = 1000000000000ULL+1000000;
+	auto small = prime_sieve(1000001);
+	std::vector<bool> win(hi-lo, true);
+	for (uint64_t p=2; p<small.size(); p++)
+		if (small[p])
+			for (uint64_t m=(lo+p-1)/p*p; m<hi; m+=p)
+				win[m-lo] = false;
+	std::vector<uint64_t> got, exp;
+	prime_sieve_each(lo, hi, [&](uint64_t p) { got.push_back(p); });
+	for (uint64_t i=lo; i<hi; i++)
+		if (win[i-lo])
+			exp.push_back(i);
+	EXPECT_EQ(exp, got);
+}
+
+TEST(Prime, SegmentedSievePerformance) {
+	constexpr int n = 100000000;
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	auto seave = prime_sieve(n);
+	int64_t cnt_plain = std::count(seave.begin(), seave.end(), true);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> plain = end-start;
+	start = std::chrono::system_clock::now();
+	int64_t cnt_seg = 0;
+	prime_sieve_each(0, n, [&](uint64_t) { cnt_seg++; });
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> seg = end-start;
+	EXPECT_EQ(5761455, cnt_plain);
+	EXPECT_EQ(cnt_plain, cnt_seg);
+	std::cerr << "[          ] primes below " << n << ": prime_sieve = " << plain.count() << " segmented = " << seg.count() << std::endl;
+	start = std::chrono::system_clock::now();
+	int64_t cnt_1e12 = 0;
+	prime_sieve_each(1000000000000ULL, 1000000000000ULL+100000000, [&](uint64_t) { cnt_1e12++; });
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> far = end-start;
+	std::cerr << "[          ] " << cnt_1e12 << " primes in [1e12, 1e12+1e8) segmented = " << far.count() << std::endl;
+}
+
+TEST(Prime, ParallelSieve) {
+	auto seave = prime_sieve(3000000);
+	for (int nthreads:{1, 2, 3, 8}) {
+		ParPrimeSieve sieve(nthreads);
+		for (uint64_t lo:{0, 7, 31, 999983}) {
+			for (uint64_t hi:{lo, lo+1, lo+100, lo+1000000, uint64_t(3000000)}) {
+				std::vector<uint64_t> got, exp;
+				sieve.each(lo, hi, [&](uint64_t p) { got.push_back(p); });
+				for (uint64_t i=lo; i<hi; i++)
+					if (seave[i])
+						exp.push_back(i);
+				EXPECT_EQ(exp, got) << "lo=" << lo << " hi=" << hi;
+				EXPECT_EQ(exp.size(), sieve.count(lo, hi)) << "lo=" << lo << " hi=" << hi;
+			}
+		}
+	}
+}
+
+TEST(Prime, PrimePi) {
+	auto seave = prime_sieve(100000);
+	uint64_t cnt = 0;
+	for (uint64_t n=0; n<100000; n++) {
+		cnt += seave[n];
+		if (n < 1000 || n % 997 == 0) {
+			EXPECT_EQ(cnt, prime_pi(n)) << "n=" << n;
+		}
+	}
+	EXPECT_EQ(50847534U, prime_pi(1000000000ULL));
+	EXPECT_EQ(4118054813ULL, prime_pi(100000000000ULL));
+}
+
+TEST(Prime, ParallelSieveScaling) {
+	const int hw = std::max(1U, std::thread::hardware_concurrency());
+	std::vector<int> threads {1, 4};
+	if (hw > 4)
+		threads.push_back(hw);
+	const uint64_t pi[] = {0, 4, 25, 168, 1229, 9592, 78498, 664579, 5761455, 50847534, 455052511, 4118054813ULL};
+	for (int e:{8, 9, 10}) {
+		uint64_t n = 1;
+		for (int i=0; i<e; i++)
+			n *= 10;
+		for (int nthreads:threads) {
+			ParPrimeSieve sieve(nthreads);
+			std::chrono::time_point<std::chrono::system_clock> start, end;
+			start = std::chrono::system_clock::now();
+			uint64_t cnt = sieve.count(0, n);
+			end = std::chrono::system_clock::now();
+			std::chrono::duration<double> d = end-start;
+			EXPECT_EQ(pi[e], cnt);
+			std::cerr << "[          ] sieve count below 1e" << e << " threads=" << nthreads << " " << d.count() << " sec" << std::endl;
+		}
+	}
+	for (int e:{9, 10, 11}) {
+		uint64_t n = 1;
+		for (int i=0; i<e; i++)
+			n *= 10;
+		std::chrono::time_point<std::chrono::system_clock> start, end;
+		start = std::chrono::system_clock::now();
+		uint64_t cnt = prime_pi(n);
+		end = std::chrono::system_clock::now();
+		std::chrono::duration<double> d = end-start;
+		EXPECT_EQ(pi[e], cnt);
+		std::cerr << "[          ] prime_pi(1e" << e << ") " << d.count() << " sec" << std::endl;
+	}
+}
+
+TEST(Prime, IsPrime) {
+	auto seave = prime_sieve(100000);
+	for (uint64_t n=0; n<100000; n++)
+		EXPECT_EQ(bool(seave[n]), is_prime(n)) << "n=" << n;
+	// strong pseudoprimes to several bases and large primes
+	EXPECT_FALSE(is_prime(3215031751ULL));
+	EXPECT_FALSE(is_prime(3825123056546413051ULL));
+	EXPECT_FALSE(is_prime(341550071728321ULL));	// strong pseudoprime to bases 2..17
+	EXPECT_TRUE(is_prime(18446744073709551557ULL));	// largest 64-bit prime
+	EXPECT_FALSE(is_prime(18446744073709551615ULL));
+	EXPECT_TRUE(is_prime(4611686018427387847ULL));	// largest 62-bit prime
+	EXPECT_TRUE(is_prime(1000000007ULL));
+	EXPECT_FALSE(is_prime(1000000007ULL*1000000009ULL));
+}
+
+// trial division reference
+static int naive_factors_all(uint64_t n, uint64_t p[]) {
+	int np = 0;
+	for (uint64_t i = 2; i <= n / i; i++) {
+		while (n % i == 0) {
+			p[np++] = i;
+			n /= i;
+		}
+	}
+	if (n > 1)
+		p[np++] = n;
+	return np;
+}
+
+static uint64_t random_prime(int bits) {
+	while (true) {
+		uint64_t n = ((uint64_t(rand()) << 31) ^ rand()) & ((1ULL << bits)-1);
+		n |= 1ULL << (bits-1);
+		if (is_prime(n))
+			return n;
+	}
+}
+
+TEST(Prime, FactorsRho) {
+	// every product is checked against trial division
+	for (int iter=0; iter<200; iter++) {
+		uint64_t n = 1;
+		while (n < (1ULL << 40))
+			n *= rand() % 2 ? random_prime(2+rand()%14) : 1+rand()%1000;
+		uint64_t ff[64], exp[64];
+		int ff_sz = prime_factors_all(n, ff);
+		int exp_sz = naive_factors_all(n, exp);
+		ASSERT_EQ(exp_sz, ff_sz) << "n=" << n;
+		EXPECT_TRUE(vector_cmp(ff, ff+ff_sz, exp)) << "n=" << n;
+	}
+	// semiprimes with equal and distinct factors, prime squares
+	for (int bits:{17, 24, 31}) {
+		uint64_t a = random_prime(bits), b = random_prime(bits);
+		for (uint64_t n:{a*b, a*a, a*a*random_prime(64-2*bits)}) {
+			uint64_t ff[64];
+			int ff_sz = prime_factors_all(n, ff);
+			EXPECT_EQ(std::accumulate(ff, ff+ff_sz, 1ULL, std::multiplies<uint64_t>()), n);
+			EXPECT_TRUE(std::is_sorted(ff, ff+ff_sz));
+			for (int i=0; i<ff_sz; i++)
+				EXPECT_TRUE(is_prime(ff[i]));
+		}
+	}
+	std::pair<uint64_t,int> uqff[15];
+	uint64_t a = random_prime(15), b = random_prime(16);
+	int uqff_sz = prime_factors_uniq(a*a*a*b, uqff);
+	ASSERT_EQ(2, uqff_sz);
+	EXPECT_EQ(std::make_pair(a, 3), uqff[0]);
+	EXPECT_EQ(std::make_pair(b, 1), uqff[1]);
+}
+
+TEST(Prime, FactorsRhoPerformance) {
+	std::vector<uint64_t> small, large;
+	for (int i=0; i<10; i++)
+		small.push_back(random_prime(24)*random_prime(24));
+	for (int i=0; i<1000; i++)
+		large.push_back(random_prime(31)*random_prime(31));
+	uint64_t ff[64];
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	for (auto n:small)
+		EXPECT_EQ(2, naive_factors_all(n, ff));
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> naive = end-start;
+	start = std::chrono::system_clock::now();
+	for (auto n:small)
+		EXPECT_EQ(2, prime_factors_all(n, ff));
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> rho_small = end-start;
+	start = std::chrono::system_clock::now();
+	for (auto n:large)
+		EXPECT_EQ(2, prime_factors_all(n, ff));
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> rho_large = end-start;
+	std::cerr << "[          ] 48-bit semiprime: trial division = " << naive.count()/small.size()
+		<< " sec, rho = " << rho_small.count()/small.size() << " sec" << std::endl;
+	std::cerr << "[          ] 62-bit semiprime: rho = " << rho_large.count()/large.size()
+		<< " sec, trial division ~ " << naive.count()/small.size()*(1<<7) << " sec extrapolated" << std::endl;
+}
+
+TEST(Prime, SpfTable) {
+	constexpr uint32_t limit = 100000;
+	SpfTable spf(limit);
+	auto seave = prime_sieve(limit);
+	for (uint32_t n=1; n<limit; n++) {
+		if (n > 1) {
+			EXPECT_EQ(seave[n], spf.smallest(n) == n) << "n=" << n;
+		}
+		uint32_t ff[32];
+		uint64_t exp[64];
+		int ff_sz = spf.factors_all(n, ff);
+		int exp_sz = prime_factors_all(n, exp);
+		ASSERT_EQ(exp_sz, ff_sz) << "n=" << n;
+		EXPECT_TRUE(std::equal(ff, ff+ff_sz, exp)) << "n=" << n;
+		std::pair<uint32_t,int> uq[9];
+		std::pair<uint64_t,int> exp_uq[15];
+		int uq_sz = spf.factors_uniq(n, uq);
+		int exp_uq_sz = prime_factors_uniq(n, exp_uq);
+		ASSERT_EQ(exp_uq_sz, uq_sz) << "n=" << n;
+		for (int i=0; i<uq_sz; i++)
+			EXPECT_TRUE(uq[i].first == exp_uq[i].first && uq[i].second == exp_uq[i].second) << "n=" << n;
+	}
+}
+
+TEST(Prime, ParFactor) {
+	SpfTable spf(1<<20);
+	std::vector<uint32_t> in(10007);
+	for (auto &n:in)
+		n = 1+rand()%((1<<20)-1);
+	for (int nthreads:{1, 3, 8}) {
+		ParFactor pf(spf, nthreads);
+		std::vector<uint32_t> factors;
+		std::vector<size_t> offsets;
+		pf.factor(in.data(), in.size(), factors, offsets);
+		ASSERT_EQ(in.size()+1, offsets.size());
+		EXPECT_EQ(factors.size(), offsets.back());
+		for (size_t i=0; i<in.size(); i++) {
+			uint32_t ff[32];
+			int ff_sz = spf.factors_all(in[i], ff);
+			ASSERT_EQ(size_t(ff_sz), offsets[i+1]-offsets[i]);
+			EXPECT_TRUE(std::equal(ff, ff+ff_sz, factors.begin()+offsets[i]));
+		}
+	}
+}
+
+TEST(Prime, SpfPerformance) {
+	constexpr uint32_t limit = 10000000;
+	constexpr int cnt = 1000000;
+	std::vector<uint32_t> in(cnt);
+	for (auto &n:in)
+		n = 1+rand()%(limit-1);
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	start = std::chrono::system_clock::now();
+	uint64_t sum_trial = 0;
+	for (auto n:in) {
+		std::pair<uint64_t,int> uq[15];
+		sum_trial += prime_factors_uniq(n, uq);
+	}
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> trial = end-start;
+	start = std::chrono::system_clock::now();
+	SpfTable spf(limit);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> build = end-start;
+	start = std::chrono::system_clock::now();
+	uint64_t sum_spf = 0;
+	for (auto n:in) {
+		std::pair<uint32_t,int> uq[9];
+		sum_spf += spf.factors_uniq(n, uq);
+	}
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> single = end-start;
+	EXPECT_EQ(sum_trial, sum_spf);
+	ParFactor pf(spf);
+	std::vector<uint32_t> factors;
+	std::vector<size_t> offsets;
+	start = std::chrono::system_clock::now();
+	pf.factor(in.data(), in.size(), factors, offsets);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> batch = end-start;
+	std::cerr << "[          ] factor " << cnt << " numbers below " << limit << ": prime_factors_uniq = " << trial.count()
+		<< " SpfTable build = " << build.count() << " factors_uniq = " << single.count()
+		<< " ParFactor batch = " << batch.count() << " sec" << std::endl;
+}
+
+struct MultFuncs {
+	uint32_t phi;
+	int mu;
+	uint64_t sigma;
+	uint32_t divisors;
+	MultFuncs(uint64_t n) {
+		std::pair<uint64_t,int> p[15];
+		int np = prime_factors_uniq(n, p);
+		phi = n;
+		mu = 1;
+		sigma = divisors = 1;
+		for (int i=0; i<np; i++) {
+			uint64_t pk = 1;
+			for (int e=0; e<p[i].second; e++)
+				pk *= p[i].first;
+			phi = phi/p[i].first*(p[i].first-1);
+			mu = p[i].second > 1 ? 0 : -mu;
+			sigma *= (pk*p[i].first-1)/(p[i].first-1);
+			divisors *= p[i].second+1;
+		}
+	}
+};
+
+static void check_mult_funcs(const MultFuncSieve &mf, int funcs) {
+	uint64_t n = mf.first();
+	if (n == 0 && mf.last() > 0) {
+		if (funcs & MF_PHI) {
+			EXPECT_EQ(0U, mf.phi(0));
+		}
+		if (funcs & MF_MU) {
+			EXPECT_EQ(0, mf.mu(0));
+		}
+		if (funcs & MF_SIGMA) {
+			EXPECT_EQ(0U, mf.sigma(0));
+		}
+		if (funcs & MF_DIVISORS) {
+			EXPECT_EQ(0U, mf.divisors(0));
+		}
+		n++;
+	}
+	for (; n<mf.last(); n++) {
+		MultFuncs exp(n);
+		if (funcs & MF_PHI) {
+			ASSERT_EQ(exp.phi, mf.phi(n)) << "n=" << n;
+		}
+		if (funcs & MF_MU) {
+			ASSERT_EQ(exp.mu, mf.mu(n)) << "n=" << n;
+		}
+		if (funcs & MF_SIGMA) {
+			ASSERT_EQ(exp.sigma, mf.sigma(n)) << "n=" << n;
+		}
+		if (funcs & MF_DIVISORS) {
+			ASSERT_EQ(exp.divisors, mf.divisors(n)) << "n=" << n;
+		}
+	}
+}
+
+TEST(Prime, MultFuncSieve) {
+	for (uint32_t n:{0, 1, 2, 3, 100000})
+		check_mult_funcs(MultFuncSieve(n), MF_ALL);
+	MultFuncSieve mu(1000, MF_MU);
+	check_mult_funcs(mu, MF_MU);
+	EXPECT_EQ(1000U, mu.bytes());
+	auto sprimes = MultFuncSieve::sieving_primes(100000);
+	for (auto r:std::vector<std::pair<uint64_t,uint64_t>>{{0, 1}, {0, 777}, {1, 2}, {500, 501}, {9973, 100000}})
+		check_mult_funcs(MultFuncSieve(r.first, r.second, MF_ALL, sprimes), MF_ALL);
+	const uint64_t top = 1ULL<<32;
+	sprimes = MultFuncSieve::sieving_primes(top);
+	check_mult_funcs(MultFuncSieve(top-20000, top, MF_ALL, sprimes), MF_ALL);
+	check_mult_funcs(MultFuncSieve(top-1000, top, MF_PHI|MF_DIVISORS, sprimes), MF_PHI|MF_DIVISORS);
+	EXPECT_THROW(MultFuncSieve seg(top-1000, top+1, MF_PHI, sprimes), std::out_of_range);
+	uint64_t next = 12345;
+	mult_func_each(12345, 12345+3*MultFuncSieve::segment_size+17, MF_ALL, [&](const MultFuncSieve &seg) {
+		EXPECT_EQ(next, seg.first());
+		next = seg.last();
+		check_mult_funcs(seg, MF_ALL);
+	});
+	EXPECT_EQ(12345+3*MultFuncSieve::segment_size+17, next);
+}
+
+TEST(Prime, MultFuncSievePerformance) {
+	constexpr uint32_t n = 10000000;
+	std::chrono::time_point<std::chrono::system_clock> start, end;
+	// one O(n log n) divisor loop and one phi sieve per function
+	start = std::chrono::system_clock::now();
+	std::vector<uint32_t> phi(n), divisors(n);
+	std::vector<int8_t> mu(n, 1);
+	std::vector<uint64_t> sigma(n);
+	for (uint32_t i=0; i<n; i++)
+		phi[i] = i;
+	for (uint32_t p=2; p<n; p++)
+		if (phi[p] == p)
+			for (uint32_t m=p; m<n; m+=p)
+				phi[m] -= phi[m]/p;
+	auto pr = prime_sieve(n);
+	for (uint64_t p=2; p<n; p++)
+		if (pr[p]) {
+			for (uint64_t m=p; m<n; m+=p)
+				mu[m] = -mu[m];
+			for (uint64_t m=p*p; m<n; m+=p*p)
+				mu[m] = 0;
+		}
+	for (uint32_t d=1; d<n; d++)
+		for (uint32_t m=d; m<n; m+=d) {
+			sigma[m] += d;
+			divisors[m]++;
+		}
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> loops = end-start;
+	start = std::chrono::system_clock::now();
+	MultFuncSieve all(n);
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> linear = end-start;
+	for (uint32_t i=1; i<n; i+=997) {
+		ASSERT_EQ(phi[i], all.phi(i)) << "i=" << i;
+		ASSERT_EQ(mu[i], all.mu(i)) << "i=" << i;
+		ASSERT_EQ(sigma[i], all.sigma(i)) << "i=" << i;
+		ASSERT_EQ(divisors[i], all.divisors(i)) << "i=" << i;
+	}
+	start = std::chrono::system_clock::now();
+	uint64_t seg_bytes = 0, sum = 0;
+	mult_func_each(0, n, MF_ALL, [&](const MultFuncSieve &seg) {
+		seg_bytes = std::max(seg_bytes, seg.bytes());
+		sum += seg.phi(seg.last()-1);
+	});
+	end = std::chrono::system_clock::now();
+	std::chrono::duration<double> segmented = end-start;
+	EXPECT_GT(sum, 0U);
+	std::cerr << "[          ] multiplicative functions below " << n << ": separate loops = " << loops.count()
+		<< " linear sieve = " << linear.count() << " (" << n/linear.count()/1e6 << " M/sec)"
+		<< " segmented = " << segmented.count() << " (" << n/segmented.count()/1e6 << " M/sec) sec" << std::endl;
+	std::cerr << "[          ] memory: linear sieve tables = " << all.bytes()/(1<<20) << " MB + "
+		<< uint64_t(n)*sizeof(uint32_t)/(1<<20) << " MB temporary, segment = " << seg_bytes/1024 << " KB" << std::endl;
+}
@@ -2,6 +2,7 @@
 #include "gtest/gtest.h"
 #include <numeric>
 #include <random>
+#include <algorithm>
 
 TEST(BotUpSegTree, Sum0) {
 	BotUpSegTree<> sum({1,2,3});
@@ -306,3 +307,25 @@ TEST(LazySegTree, MulRandRandAndSet) {
 		}
 	}
 }
+
+struct FoldMax {
+	int operator()(int a, int b) const {
+		return std::max(a, b);
+	}
+};
+
+TEST(SparseTable, MinMax) {
+	std::mt19937 gen(1);
+	std::vector<int> v(1000);
+	for (auto &x:v)
+		x = gen()%1000;
+	SparseTable<> mn(v);
+	SparseTable<int,FoldMax> mx(v);
+	for (int t=0; t<10000; t++) {
+		int b = gen()%v.size();
+		int e = b+1+gen()%(v.size()-b);
+		EXPECT_EQ(*std::min_element(v.begin()+b, v.begin()+e), mn(b, e));
+		EXPECT_EQ(*std::max_element(v.begin()+b, v.begin()+e), mx(b, e));
+	}
+	EXPECT_EQ(1000, mn.size());
+}